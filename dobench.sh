@@ -0,0 +1,65 @@
+#!/bin/bash
+#
+# benchmark of the variants of captures: size, extraction and restore times,
+# and time of the queries of all the files of an indexed capture
+#
+# usage: dobench.sh [COUNT [VARIANT...]]
+#
+# A tree of COUNT files is created in bench/ and its attributes are
+# extracted using each VARIANT of options of sec-xattr-extract.
+# Variants unsupported by the build are skipped.
+
+count=${1:-20000}
+shift
+if [[ $# -eq 0 ]]
+then
+	set -- "" "-s" "-z zstd" "-s -z zstd" "-z zstd:3" "-z lz4" "-s -z lz4" "-z lz4:1"
+fi
+
+TIMEFORMAT=%3R
+
+# generate the attributes of the tree
+gen() {
+	awk -v n="$count" 'BEGIN {
+		srand(1)
+		split("System System::Shared _ User::Home App::org.example.application", lbl, " ")
+		for (i = 0 ; i < n ; i++) {
+			printf "# file: bench/d%03d/s%d/libfoo.so.%d.%d\n", i / 100, (i / 20) % 5, i % 7, i
+			printf "security.SMACK64=\"%s\"\n", lbl[1 + int(rand() * 5)]
+			if (rand() < 0.3)
+				printf "security.SMACK64EXEC=\"%s\"\n", lbl[1 + int(rand() * 5)]
+			printf "\n"
+		}
+	}' |
+	if [[ $(id -u) -eq 0 ]]
+	then
+		cat
+	else
+		sed 's/^security\./user./'
+	fi
+}
+
+# create the tree
+rm -rf bench
+gen > bench.fattr
+awk '/^# file:/{print $3}' bench.fattr | xargs -n 1 dirname | sort -u | xargs mkdir -p
+awk '/^# file:/{print $3}' bench.fattr | xargs touch
+setfattr --restore bench.fattr
+
+# measure
+printf "%-16s %10s %10s %10s %10s %10s\n" variant size extract decode restore pipe
+for v in "$@"
+do
+	text=$( { time ./sec-xattr-extract $v out.bench bench ; } 2>&1 ) || continue
+	size=$(stat -c %s out.bench)
+	decode=$( { time ./sec-xattr-restore -d out.bench bench > /dev/null ; } 2>&1 )
+	restore=$( { time ./sec-xattr-restore out.bench bench ; } 2>&1 )
+	pipe=$( { time cat out.bench | ./sec-xattr-restore - bench ; } 2>&1 )
+	printf "%-16s %10s %10s %10s %10s %10s\n" "${v:-v1}" "$size" "$text" "$decode" "$restore" "$pipe"
+done
+
+# query every file of an indexed capture
+./sec-xattr-extract -i out.bench bench
+query=$( { time awk '/^# file:/{print substr($3, 7)}' bench.fattr | ./sec-xattr-query out.bench > /dev/null ; } 2>&1 )
+printf "query of %s files %s\n" "$count" "$query"
+rm -rf bench bench.fattr out.bench
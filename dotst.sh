@@ -79,4 +79,251 @@ then
 	echo "ERROR detected in raw ouput"
 	exit 1
 fi
+
+# check that the dump isn't mixed with a capture to the standard output
+if ./sec-xattr-extract -d - dirin > /dev/null 2>&1
+then
+	echo "ERROR detected: dump to the standard output accepted"
+	exit 1
+fi
+
+# check that crossing directories of the same file system changes nothing
+./sec-xattr-extract -x data -x data/subdata1 out.x.extr dirin
+if ! cmp out.x.extr out.extr
+then
+	echo "ERROR detected in ouput of crossed directories"
+	exit 1
+fi
+
+# check that a stamped restore is skipped the next time
+rm -f out.stamp
+./sec-xattr-restore -S out.stamp out.extr dirout
+setfattr -n user.name0 -v stamped dirout/data/subdata1/file3
+./sec-xattr-restore -S out.stamp out.extr dirout
+if [ ! -s out.stamp ] || [ "$(getfattr -n user.name0 --only-values dirout/data/subdata1/file3)" != stamped ]
+then
+	echo "ERROR detected in stamped restore"
+	exit 1
+fi
+
+# check the variants through a pipe
+for variant in "-s" "-f" "-s -f" "-p ^/data/subdata1/ -p ^/data$"
+do
+	rm -rf dirout
+	dl "dirout/" | xargs mkdir -p
+	fl "dirout/" | xargs touch
+	./sec-xattr-extract $variant - dirin | ./sec-xattr-restore - dirout
+	getfattr -R -d dirout | sed 's,dirout,,' > out.out.fattr
+	if ! cmp out.out.fattr out.in.fattr
+	then
+		echo "ERROR detected in ouput of variant $variant"
+		exit 1
+	fi
+done
+
+# check the compressed captures, skipping the methods not built in
+for variant in "-z zstd" "-s -z zstd" "-z zstd:3 -D out.extr" "-z lz4" "-s -z lz4"
+do
+	dict=
+	case "$variant" in
+	*-D*) dict="-D ${variant##*-D }" ;;
+	esac
+	if ! ./sec-xattr-extract $variant out.z.extr dirin 2> out.z.err
+	then
+		grep -q "unsupported compression" out.z.err && continue
+		echo "ERROR detected in extraction of variant $variant"
+		exit 1
+	fi
+	rm -rf dirout
+	dl "dirout/" | xargs mkdir -p
+	fl "dirout/" | xargs touch
+	./sec-xattr-restore $dict out.z.extr dirout
+	getfattr -R -d dirout | sed 's,dirout,,' > out.out.fattr
+	if ! cmp out.out.fattr out.in.fattr
+	then
+		echo "ERROR detected in ouput of variant $variant"
+		exit 1
+	fi
+done
+
+# check the classes restored in background after the exec of a program
+# and of the signal when the second restore is skipped by the stamp
+rm -rf dirout out.bstamp
+dl "dirout/" | xargs mkdir -p
+fl "dirout/" | xargs touch
+./sec-xattr-extract -p ^/data/subdata1/ out.p.extr dirin
+for run in restored stamped
+do
+	rm -f out.ready out.sig
+	./sec-xattr-restore -S out.bstamp -r out.ready -k $(kill -l USR1) out.p.extr dirout /bin/sh -c '
+		trap "touch out.sig" USR1
+		i=0
+		while [ ! -e out.sig ] && [ $i -lt 100 ]
+		do
+			sleep 0.1
+			i=$((i + 1))
+		done'
+	getfattr -R -d dirout | sed 's,dirout,,' > out.out.fattr
+	if ! cmp out.out.fattr out.in.fattr || [ ! -e out.ready ] || [ ! -e out.sig ]
+	then
+		echo "ERROR detected in background restore, $run"
+		exit 1
+	fi
+done
+
+# check the resume from a checkpoint in the middle of the second class
+./sec-xattr-restore -S out.pstamp out.p.extr dirout
+for file in subdata1/file3 subdata3/file4 subdata3/file2
+do
+	setfattr -n user.name0 -v changed dirout/data/$file
+done
+offset=$(./sec-xattr-debug out.p.extr / |
+	awk '/^CLASS 1/ { c = 1; next } c && !s { s = $1 } c && / FILE .* file4$/ { print $1 - s; exit }')
+echo "$(cat out.pstamp) 1 $offset" > out.check
+./sec-xattr-restore -c out.check --resume out.p.extr dirout
+if [ -e out.check ] ||
+   [ "$(getfattr -n user.name0 --only-values dirout/data/subdata1/file3)" != changed ] ||
+   [ "$(getfattr -n user.name0 --only-values dirout/data/subdata3/file2)" != changed ] ||
+   [ "$(getfattr -n user.name0 --only-values dirout/data/subdata3/file4)" != value7 ]
+then
+	echo "ERROR detected in resumed restore"
+	exit 1
+fi
+# a truncated checkpoint is ignored and all is restored
+echo "$(cat out.pstamp) 1" | tr -d '\n' > out.check
+./sec-xattr-restore -c out.check --resume out.p.extr dirout 2> out.check.err
+getfattr -R -d dirout | sed 's,dirout,,' > out.out.fattr
+if ! cmp out.out.fattr out.in.fattr || ! grep -q "invalid checkpoint" out.check.err
+then
+	echo "ERROR detected in restore with a truncated checkpoint"
+	exit 1
+fi
+
+# check the extraction from a tar archive
+rm -rf dirout
+dl "dirout/" | xargs mkdir -p
+fl "dirout/" | xargs touch
+tar --xattrs --xattrs-include='*' --format=pax -C dirin -cf - . |
+./sec-xattr-extract -t out.tar.extr -
+./sec-xattr-restore out.tar.extr dirout
+getfattr -R -d dirout | sed 's,dirout,,' > out.out.fattr
+if ! cmp out.out.fattr out.in.fattr
+then
+	echo "ERROR detected in ouput of tar extraction"
+	exit 1
+fi
+
+# check that tar entries escaping the root are refused
+if tar --xattrs --xattrs-include='*' --format=pax -P --transform='s,^data,../data,' \
+	-C dirin -cf - data/subdata1/file1 2> /dev/null |
+   ./sec-xattr-extract -t out.tar.extr - 2> /dev/null
+then
+	echo "ERROR detected: tar entry out of root accepted"
+	exit 1
+fi
+
+# check the snapshots of an archive
+./sec-xattr-extract -f out.f.extr dirin
+./sec-xattr-archive out.arch raw=out.extr front=out.f.extr
+for name in raw front
+do
+	rm -rf dirout
+	dl "dirout/" | xargs mkdir -p
+	fl "dirout/" | xargs touch
+	./sec-xattr-restore -n $name out.arch dirout
+	getfattr -R -d dirout | sed 's,dirout,,' > out.out.fattr
+	if ! cmp out.out.fattr out.in.fattr
+	then
+		echo "ERROR detected in ouput of snapshot $name"
+		exit 1
+	fi
+done
+# check the queries of an indexed capture
+./sec-xattr-extract -i -f out.i.extr dirin
+./sec-xattr-query out.i.extr /data/subdata1/file3 data/subdata2 | sort > out.query
+printf "%s\t%s\t%s\n" \
+	/data/subdata1/file3 user.name0 value8 \
+	/data/subdata1/file3 user.name1 value9 \
+	data/subdata2 user.name3 value0 \
+	data/subdata2 user.name4 value1 | sort > out.query.expected
+if ! cmp out.query out.query.expected
+then
+	echo "ERROR detected in queries"
+	exit 1
+fi
+# check the exports and the statistics of sec-xattr-debug
+./sec-xattr-debug -t out.extr dirin > out.tsv
+./sec-xattr-debug -s out.extr dirin > out.stats
+if ! grep -qx "$(printf 'dirin/data/subdata1/file3\tuser.name0\tvalue8')" out.tsv ||
+   ! grep -qx "ops SET $(wc -l < out.tsv)" out.stats
+then
+	echo "ERROR detected in export or statistics"
+	exit 1
+fi
+for capture in "out.extr" "-n front out.arch"
+do
+	if [ "$(./sec-xattr-debug -s $capture / | awk '$1 == "bytes" { n += $3 } END { print n }')" \
+	     != "$(wc -c < ${capture##* })" ]
+	then
+		echo "ERROR detected in statistics of $capture"
+		exit 1
+	fi
+done
+# check that a corrupted code of the stream variant is rejected cleanly
+./sec-xattr-extract -s out.bad.extr dirin
+strsz=$(od -An -tu4 -j 20 -N 4 out.bad.extr | tr -d ' ')
+printf '\377\377\377\377' | dd of=out.bad.extr bs=1 seek=$((28 + strsz)) conv=notrunc 2> /dev/null
+for tool in "./sec-xattr-debug -s out.bad.extr /" "./sec-xattr-debug out.bad.extr /" \
+	"./sec-xattr-archive out.bad.arch out.bad.extr" "./sec-xattr-restore -d out.bad.extr /"
+do
+	$tool > /dev/null 2>&1
+	if [ $? -ne 1 ]
+	then
+		echo "ERROR detected: corrupted code not rejected by $tool"
+		exit 1
+	fi
+done
+
+rm -rf dirj
+mkdir dirj
+touch dirj/file
+setfattr -n user.bin -v 0x41e90a22 dirj/file
+./sec-xattr-extract out.j.extr dirj
+./sec-xattr-debug -j out.j.extr dirj > out.json
+printf '%s\n' '[' '{"path":"dirj/file","attr":"user.bin","value":"A\u00e9\n\""}' ']' > out.json.expected
+if ! cmp out.json out.json.expected
+then
+	echo "ERROR detected in JSON export"
+	exit 1
+fi
+
+# check the watch of changes, the last check as it changes dirin
+rm -f out.w.extr
+./sec-xattr-extract -w 0 out.w.extr dirin &
+pid=$!
+i=0
+while [ ! -e out.w.extr ] && [ $i -lt 100 ]
+do
+	sleep 0.1
+	i=$((i + 1))
+done
+setfattr -n user.name9 -v watched dirin/data/subdata3/file4
+mkdir -p dirin/data/subdata4/sub
+touch dirin/data/subdata4/sub/file5
+setfattr -n user.name0 -v new dirin/data/subdata4/sub/file5
+mv dirin/data/subdata2 dirin/data/subdata5
+rm dirin/data/subdata1/file3
+sleep 0.5
+kill -USR1 $pid
+sleep 0.5
+kill $pid
+wait $pid
+./sec-xattr-extract out.w.ref dirin
+./sec-xattr-restore -d out.w.extr dirin | sort > out.w.dump
+./sec-xattr-restore -d out.w.ref dirin | sort > out.w.ref.dump
+if ! cmp out.w.dump out.w.ref.dump || ! grep -q file5 out.w.dump
+then
+	echo "ERROR detected in watched capture"
+	exit 1
+fi
 echo "Test passed succefully"
@@ -0,0 +1,426 @@
+/*
+ * Copyright (C) 2015-2025 IoT.bzh Company
+ * Author: José Bollo <jose.bollo@iot.bzh>
+ *
+ * $RP_BEGIN_LICENSE$
+ * Commercial License Usage
+ *  Licensees holding valid commercial IoT.bzh licenses may use this file in
+ *  accordance with the commercial license agreement provided with the
+ *  Software or, alternatively, in accordance with the terms contained in
+ *  a written agreement between you and The IoT.bzh Company. For licensing terms
+ *  and conditions see https://www.iot.bzh/terms-conditions. For further
+ *  information use the contact form at https://www.iot.bzh/contact.
+ *
+ * GNU General Public License Usage
+ *  Alternatively, this file may be used under the terms of the GNU General
+ *  Public license version 3. This license is as published by the Free Software
+ *  Foundation and appearing in the file LICENSE.GPLv3 included in the packaging
+ *  of this file. Please review the following information to ensure the GNU
+ *  General Public License requirements will be met
+ *  https://www.gnu.org/licenses/gpl-3.0.html.
+ * $RP_END_LICENSE$
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "sec-xattr-cp.h"
+
+/* record an operation */
+struct recop {
+	uint32_t tag;       /* the tag of the operation */
+	struct recstr *str; /* its string or NULL for END */
+};
+
+/* record a snapshot */
+struct recsnap {
+	struct recstr *name;/* name of the snapshot */
+	size_t first;       /* index of its first operation */
+	size_t count;       /* count of its operations */
+	bool kept;          /* is it kept, not replaced by a later one */
+};
+
+/* the operations */
+struct recop *ops = NULL;
+size_t opcount = 0;
+size_t opalloc = 0;
+
+/* the snapshots */
+struct recsnap *snaps = NULL;
+size_t snapcount = 0;
+
+/* front code the names of the archive */
+bool front = false;
+
+/* current path of the read capture */
+char path[PATH_MAX];
+
+/* previous name of each depth for front coding */
+struct recstr *prevs[PATH_MAX / 2];
+
+/* output buffer */
+char outbuf[1 << 16];
+size_t outlen = 0;
+int outfd;
+
+/* add the operation */
+void addop(uint32_t tag, struct recstr *str)
+{
+	if (opcount == opalloc) {
+		opalloc = opalloc ? opalloc << 1 : 65536;
+		ops = realloc(ops, opalloc * sizeof *ops);
+		if (ops == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	ops[opcount].tag = tag;
+	ops[opcount].str = str;
+	opcount++;
+}
+
+/* put in path at offset the name of str front coded if infront, returns its length */
+size_t putname(size_t offset, const char *str, bool infront)
+{
+	size_t pre = 0, len;
+
+	if (infront)
+		pre = (size_t)(uint8_t)*str++;
+	len = strlen(str) + 1;
+	if (offset + pre + len > sizeof path) {
+		fprintf(stderr, "path too long %.*s%s\n", (int)(offset + pre), path, str);
+		exit(EXIT_FAILURE);
+	}
+	memcpy(&path[offset + pre], str, len);
+	return pre + len - 1;
+}
+
+/* add the snapshot of name whose code is read from the capture */
+void add_snapshot(struct capture *cap, const char *name)
+{
+	const char *blk = NULL, *str;
+	const uint32_t *pcode, *end;
+	uint32_t code, tag, strsz, codesz;
+	size_t offset = 0, len, depth = 0, stack[PATH_MAX / 2], idx, rest;
+	bool infront = (cap->flags & FLAG_FRONT) != 0, streamed = (cap->flags & FLAG_STREAM) != 0;
+	struct recstr *full;
+	struct recsnap *snap;
+
+	/* replace the snapshot of same name */
+	for (idx = 0 ; idx < snapcount ; idx++)
+		if (strcmp(snaps[idx].name->value, name) == 0)
+			snaps[idx].kept = false;
+
+	/* record the snapshot */
+	snaps = realloc(snaps, (snapcount + 1) * sizeof *snaps);
+	if (snaps == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	snap = &snaps[snapcount++];
+	snap->name = addstr(name, strlen(name) + 1);
+	snap->first = opcount;
+	snap->kept = true;
+
+	/* read its operations */
+	if (streamed)
+		pcode = end = NULL;
+	else {
+		pcode = (const uint32_t*)cap->body;
+		end = (const uint32_t*)&cap->base[cap->size & ~(size_t)3];
+	}
+	prevs[0] = NULL;
+	for (;;) {
+		/* get the code */
+		if (pcode >= end) {
+			if (!streamed || (blk = capture_block(cap)) == NULL) {
+				fprintf(stderr, "truncated capture %s\n", cap->path);
+				exit(EXIT_FAILURE);
+			}
+			strsz = le32toh(((const uint32_t*)blk)[0]);
+			codesz = le32toh(((const uint32_t*)blk)[1]);
+			pcode = (const uint32_t*)&blk[BLOCK_HEAD + strsz];
+			end = (const uint32_t*)&blk[BLOCK_HEAD + strsz + codesz];
+		}
+		code = le32toh(*pcode++);
+		tag = code & TAG_MASK;
+
+		/* end of directory */
+		if (code == TAG_SUB) {
+			addop(TAG_SUB, NULL);
+			if (depth == 0)
+				break;
+			offset = stack[--depth];
+			continue;
+		}
+
+		/* the string */
+		if (streamed)
+			str = capture_block_string(cap, blk, code);
+		else {
+			/* the string, and the value of SET, must be in the capture */
+			str = &((const char*)pcode)[code >> TAG_WIDTH];
+			rest = str < &cap->base[cap->size] ? (size_t)(&cap->base[cap->size] - str) : 0;
+			if (rest == 0 || (tag == TAG_SET && (rest < 2
+			 || rest - 2 < (((size_t)(uint8_t)str[0]) | (((size_t)(uint8_t)str[1]) << 8))))) {
+				fprintf(stderr, "invalid capture %s\n", cap->path);
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		/* record the operation */
+		switch (tag) {
+		case TAG_SUB:
+		case TAG_FILE:
+			len = putname(offset, str, infront);
+			full = addstr(&path[offset], len + 1);
+			addop(tag, front ? frontstr(prevs[depth], full) : full);
+			prevs[depth] = full;
+			if (tag == TAG_SUB) {
+				if (depth + 1 == sizeof stack / sizeof *stack) {
+					fprintf(stderr, "too deep %s\n", cap->path);
+					exit(EXIT_FAILURE);
+				}
+				stack[depth++] = offset;
+				offset += len + 1;
+				path[offset - 1] = '/';
+				prevs[depth] = NULL;
+			}
+			break;
+		case TAG_ATTR:
+			addop(tag, addstr(str, strlen(str) + 1));
+			break;
+		case TAG_SET:
+			len = ((size_t)(uint8_t)str[0]) | (((size_t)(uint8_t)str[1]) << 8);
+			addop(tag, addstr(str, len + 2));
+			break;
+		}
+	}
+	snap->count = opcount - snap->first;
+}
+
+/* add the snapshots of the capture or archive of spec, being [NAME=]PATH */
+void add_input(const char *spec)
+{
+	struct capture cap;
+	const char *name, *file = strchr(spec, '=');
+	char *buf;
+	uint32_t idx;
+
+	/* get the name */
+	if (file == NULL) {
+		file = spec;
+		name = strrchr(spec, '/');
+		name = name == NULL ? spec : name + 1;
+	}
+	else {
+		buf = alloc((size_t)(file - spec) + 1);
+		memcpy(buf, spec, (size_t)(file - spec));
+		buf[file - spec] = 0;
+		name = buf;
+		file++;
+	}
+
+	/* add the snapshots */
+	capture_open(&cap, file);
+	if (cap.classes > 1) {
+		fprintf(stderr, "can't archive the priority classes of %s\n", file);
+		exit(EXIT_FAILURE);
+	}
+	if (cap.snapshots == 0)
+		add_snapshot(&cap, name);
+	else
+		for (idx = 0 ; idx < cap.snapshots ; idx++)
+			add_snapshot(&cap, capture_snapshot(&cap, idx));
+	capture_close(&cap);
+}
+
+/* write the output buffer */
+void flush()
+{
+	size_t pos = 0;
+	ssize_t rc;
+
+	while (pos < outlen) {
+		rc = write(outfd, &outbuf[pos], outlen - pos);
+		if (rc < 0 && errno != EINTR) {
+			fprintf(stderr, "write error: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		if (rc > 0)
+			pos += (size_t)rc;
+	}
+	outlen = 0;
+}
+
+/* write the bytes */
+void wr(const void *ptr, size_t sz)
+{
+	size_t len;
+
+	while (sz > 0) {
+		if (outlen == sizeof outbuf)
+			flush();
+		len = sizeof outbuf - outlen;
+		len = len < sz ? len : sz;
+		memcpy(&outbuf[outlen], ptr, len);
+		outlen += len;
+		ptr = &((const char*)ptr)[len];
+		sz -= len;
+	}
+}
+
+/* write the 32 bits value */
+void wr32(uint32_t value)
+{
+	value = htole32(value);
+	wr(&value, sizeof value);
+}
+
+/* write the archive of the kept snapshots in the file of path */
+void write_archive(const char *path)
+{
+	struct recstr *str;
+	struct recop *op, *end;
+	size_t idx, count = 0, offset, pos;
+	uint64_t delta;
+
+	/* mark the used strings */
+	for (idx = 0 ; idx < snapcount ; idx++) {
+		if (snaps[idx].kept) {
+			count++;
+			snaps[idx].name->used = true;
+			for (op = &ops[snaps[idx].first], end = &op[snaps[idx].count] ; op < end ; op++)
+				if (op->str != NULL)
+					op->str->used = true;
+		}
+	}
+
+	/* compute the offsets of the strings */
+	offset = SEC_XATTR_CP_ID_LEN + 2 * sizeof(uint32_t) + count * SNAPSHOT_SIZE;
+	for (idx = 0 ; idx < snapcount ; idx++)
+		if (snaps[idx].kept)
+			offset += snaps[idx].count * sizeof(uint32_t);
+	for (str = recstrs ; str != NULL ; str = str->nxt)
+		if (str->used) {
+			str->offset = offset;
+			offset += str->size;
+		}
+	if (offset > UINT32_MAX) {
+		fprintf(stderr, "archive too big\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* open the file */
+	if (strcmp(path, "-") == 0)
+		outfd = 1;
+	else
+		outfd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (outfd < 0) {
+		fprintf(stderr, "Can't open file %s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	/* write the header and the directory */
+	wr(SEC_XATTR_CP_ID_A, SEC_XATTR_CP_ID_LEN);
+	wr32(front ? FLAG_FRONT : 0);
+	wr32((uint32_t)count);
+	pos = SEC_XATTR_CP_ID_LEN + 2 * sizeof(uint32_t) + count * SNAPSHOT_SIZE;
+	for (idx = 0 ; idx < snapcount ; idx++) {
+		if (snaps[idx].kept) {
+			wr32((uint32_t)snaps[idx].name->offset);
+			wr32((uint32_t)pos);
+			wr32((uint32_t)(snaps[idx].count * sizeof(uint32_t)));
+			pos += snaps[idx].count * sizeof(uint32_t);
+		}
+	}
+
+	/* write the codes */
+	pos = SEC_XATTR_CP_ID_LEN + 2 * sizeof(uint32_t) + count * SNAPSHOT_SIZE;
+	for (idx = 0 ; idx < snapcount ; idx++) {
+		if (!snaps[idx].kept)
+			continue;
+		for (op = &ops[snaps[idx].first], end = &op[snaps[idx].count] ; op < end ; op++) {
+			pos += sizeof(uint32_t);
+			delta = 0;
+			if (op->str != NULL) {
+				delta = op->str->offset - pos;
+				if (delta >= (1 << (32 - TAG_WIDTH))) {
+					fprintf(stderr, "archive too big\n");
+					exit(EXIT_FAILURE);
+				}
+			}
+			wr32(op->tag | ((uint32_t)delta << TAG_WIDTH));
+		}
+	}
+
+	/* write the strings */
+	for (str = recstrs ; str != NULL ; str = str->nxt)
+		if (str->used)
+			wr(str->value, str->size);
+	flush();
+	close(outfd);
+}
+
+/* list the snapshots of the archive */
+void list(const char *path)
+{
+	struct capture cap;
+	uint32_t idx;
+
+	capture_open(&cap, path);
+	for (idx = 0 ; idx < cap.snapshots ; idx++)
+		printf("%s\n", capture_snapshot(&cap, idx));
+	capture_close(&cap);
+}
+
+void usage(char **av)
+{
+	printf("usage: %s [-f] [-D dict] ARCHIVE [NAME=]CAPTURE...\n"
+	       "       %s -l ARCHIVE\n", av[0], av[0]);
+	exit(EXIT_FAILURE);
+}
+
+void main(int ac, char **av)
+{
+	int idx = 1;
+	const char *archive;
+
+	/* get options */
+	while (idx < ac && av[idx][0] == '-' && av[idx][1] != 0) {
+		if (strcmp(av[idx], "-f") == 0)
+			front = true;
+		else if (strcmp(av[idx], "-D") == 0 && idx + 1 < ac)
+			capture_dictionary(av[++idx]);
+		else if (strcmp(av[idx], "-l") == 0 && idx + 2 == ac) {
+			list(av[idx + 1]);
+			exit(EXIT_SUCCESS);
+		}
+		else
+			usage(av);
+		idx++;
+	}
+
+	/* check argument count */
+	if (idx + 2 > ac)
+		usage(av);
+
+	/* read the captures */
+	archive = av[idx];
+	while (++idx < ac)
+		add_input(av[idx]);
+
+	/* write the archive */
+	write_archive(archive);
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,1066 @@
+/*
+ * Copyright (C) 2015-2025 IoT.bzh Company
+ * Author: José Bollo <jose.bollo@iot.bzh>
+ *
+ * $RP_BEGIN_LICENSE$
+ * Commercial License Usage
+ *  Licensees holding valid commercial IoT.bzh licenses may use this file in
+ *  accordance with the commercial license agreement provided with the
+ *  Software or, alternatively, in accordance with the terms contained in
+ *  a written agreement between you and The IoT.bzh Company. For licensing terms
+ *  and conditions see https://www.iot.bzh/terms-conditions. For further
+ *  information use the contact form at https://www.iot.bzh/contact.
+ *
+ * GNU General Public License Usage
+ *  Alternatively, this file may be used under the terms of the GNU General
+ *  Public license version 3. This license is as published by the Free Software
+ *  Foundation and appearing in the file LICENSE.GPLv3 included in the packaging
+ *  of this file. Please review the following information to ensure the GNU
+ *  General Public License requirements will be met
+ *  https://www.gnu.org/licenses/gpl-3.0.html.
+ * $RP_END_LICENSE$
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#if WITH_ZSTD
+#include <zstd.h>
+#endif
+#if WITH_LZ4
+#include <lz4frame.h>
+#endif
+
+#include "sec-xattr-cp.h"
+
+/* count of blocks buffered when streaming */
+#define NBUFS 4
+
+/* offset of the directory of archives */
+#define ARCHIVE_DIR (SEC_XATTR_CP_ID_LEN + 2 * sizeof(uint32_t))
+
+/* offset of the offsets of the codes of classes */
+#define CLASS_DIR (SEC_XATTR_CP_ID_LEN + 2 * sizeof(uint32_t))
+
+/* size of the buffer of compressed data read from files */
+#define ZBUFSZ (1 << 17)
+
+/* path of the dictionary for decompression or NULL */
+static const char *dictpath = NULL;
+
+/* decompression of compressed captures */
+static struct {
+	uint32_t method;           /* the compression method or 0 */
+	uint64_t size;             /* the uncompressed size or 0 if unknown */
+	int fd;                    /* the file to read or -1 if in memory */
+	char *buf;                 /* buffer of data read from the file */
+	const char *src;           /* the compressed data available */
+	size_t srcsz;              /* size of the available compressed data */
+	size_t srcpos;             /* position in the compressed data */
+	bool pending;              /* is decompressed data pending */
+	bool complete;             /* is the compressed frame complete */
+#if WITH_ZSTD
+	ZSTD_DCtx *zstd;           /* zstd decompression context */
+#endif
+#if WITH_LZ4
+	LZ4F_dctx *lz4;            /* lz4 decompression context */
+#endif
+} unz;
+
+/* reader of the blocks of a streamed capture */
+static struct {
+	pthread_t thread;          /* the thread reading blocks */
+	pthread_mutex_t mutex;     /* protection of counts */
+	pthread_cond_t cond;       /* signaling changes of counts */
+	char *bufs[NBUFS];         /* the buffers for blocks */
+	unsigned produced;         /* count of blocks read */
+	unsigned consumed;         /* count of blocks released */
+	bool held;                 /* is a block held by the consumer */
+	bool ended;                /* is the end of the input reached */
+} reader = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER
+};
+
+/* read at most sz bytes of the capture, decompressing it if needed */
+static ssize_t input(struct capture *cap, void *ptr, size_t sz)
+{
+	ssize_t rc;
+	size_t in, out, ret = 0;
+
+	if (unz.method == 0)
+		return read(cap->fd, ptr, sz);
+
+	for (;;) {
+		/* get compressed data */
+		if (unz.srcpos == unz.srcsz && !unz.pending) {
+			if (unz.fd >= 0) {
+				rc = read(unz.fd, unz.buf, ZBUFSZ);
+				if (rc < 0)
+					return rc;
+				unz.src = unz.buf;
+				unz.srcsz = (size_t)rc;
+				unz.srcpos = 0;
+			}
+			if (unz.srcpos == unz.srcsz) {
+				if (!unz.complete) {
+					fprintf(stderr, "%s is truncated\n", cap->path);
+					exit(EXIT_FAILURE);
+				}
+				return 0;
+			}
+		}
+
+		/* decompress it */
+		in = unz.srcsz - unz.srcpos;
+		out = sz;
+		switch (unz.method) {
+#if WITH_ZSTD
+		case ZMETHOD_ZSTD: {
+			ZSTD_inBuffer zin = { unz.src, unz.srcsz, unz.srcpos };
+			ZSTD_outBuffer zout = { ptr, sz, 0 };
+			ret = ZSTD_decompressStream(unz.zstd, &zout, &zin);
+			if (ZSTD_isError(ret)) {
+				fprintf(stderr, "failed to decompress %s: %s\n", cap->path, ZSTD_getErrorName(ret));
+				exit(EXIT_FAILURE);
+			}
+			in = zin.pos - unz.srcpos;
+			out = zout.pos;
+			break;
+		}
+#endif
+#if WITH_LZ4
+		case ZMETHOD_LZ4:
+			ret = LZ4F_decompress(unz.lz4, ptr, &out, &unz.src[unz.srcpos], &in, NULL);
+			if (LZ4F_isError(ret)) {
+				fprintf(stderr, "failed to decompress %s: %s\n", cap->path, LZ4F_getErrorName(ret));
+				exit(EXIT_FAILURE);
+			}
+			break;
+#endif
+		}
+		unz.srcpos += in;
+		if (in > 0 || out > 0)
+			unz.complete = ret == 0;
+		unz.pending = out == sz;
+		if (out > 0)
+			return (ssize_t)out;
+	}
+}
+
+/* read exactly sz bytes, returns false at end of file before any byte */
+static bool rdfull(struct capture *cap, void *ptr, size_t sz)
+{
+	ssize_t rc;
+	size_t pos = 0;
+
+	while (pos < sz) {
+		rc = input(cap, &((char*)ptr)[pos], sz - pos);
+		if (rc > 0)
+			pos += (size_t)rc;
+		else if (rc == 0 && pos == 0)
+			return false;
+		else if (rc == 0) {
+			fprintf(stderr, "%s is truncated\n", cap->path);
+			exit(EXIT_FAILURE);
+		}
+		else if (errno != EINTR) {
+			fprintf(stderr, "failed to read %s: %s\n", cap->path, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+	return true;
+}
+
+/* check the header of the block at ptr, returns its full size */
+static size_t block_size(struct capture *cap, const char *ptr)
+{
+	uint32_t strsz = le32toh(((const uint32_t*)ptr)[0]);
+	uint32_t codesz = le32toh(((const uint32_t*)ptr)[1]);
+
+	if (strsz > BLOCK_MAX || codesz > BLOCK_MAX
+	 || (strsz & 3) != 0 || (codesz & 3) != 0
+	 || BLOCK_HEAD + strsz + codesz > BLOCK_MAX) {
+		fprintf(stderr, "%s has an invalid block\n", cap->path);
+		exit(EXIT_FAILURE);
+	}
+	return BLOCK_HEAD + strsz + codesz;
+}
+
+/* check the strings of the block at ptr are terminated */
+static void check_strings(struct capture *cap, const char *ptr)
+{
+	uint32_t strsz = le32toh(((const uint32_t*)ptr)[0]);
+
+	if (strsz != 0 && ptr[BLOCK_HEAD + strsz - 1] != 0) {
+		fprintf(stderr, "%s has an invalid block\n", cap->path);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* unlock the mutex, also when the reader is canceled */
+static void unlock(void *mutex)
+{
+	pthread_mutex_unlock(mutex);
+}
+
+/* the thread reading the blocks of a streamed capture */
+static void *read_blocks(void *arg)
+{
+	struct capture *cap = arg;
+	char *buf;
+	size_t sz;
+
+	for (;;) {
+		/* wait for a free buffer */
+		pthread_mutex_lock(&reader.mutex);
+		pthread_cleanup_push(unlock, &reader.mutex);
+		while (reader.produced - reader.consumed >= NBUFS)
+			pthread_cond_wait(&reader.cond, &reader.mutex);
+		buf = reader.bufs[reader.produced % NBUFS];
+		pthread_cleanup_pop(1);
+
+		/* read the block in it */
+		if (!rdfull(cap, buf, BLOCK_HEAD))
+			break;
+		sz = block_size(cap, buf);
+		if (sz > BLOCK_HEAD && !rdfull(cap, &buf[BLOCK_HEAD], sz - BLOCK_HEAD)) {
+			fprintf(stderr, "%s is truncated\n", cap->path);
+			exit(EXIT_FAILURE);
+		}
+		check_strings(cap, buf);
+
+		/* publish it */
+		pthread_mutex_lock(&reader.mutex);
+		reader.produced++;
+		pthread_cond_signal(&reader.cond);
+		pthread_mutex_unlock(&reader.mutex);
+	}
+
+	/* signal the end */
+	pthread_mutex_lock(&reader.mutex);
+	reader.ended = true;
+	pthread_cond_signal(&reader.cond);
+	pthread_mutex_unlock(&reader.mutex);
+	return NULL;
+}
+
+/* start reading blocks of a streamed capture */
+static void start_stream(struct capture *cap)
+{
+	int i, rc;
+
+	for (i = 0 ; i < NBUFS ; i++) {
+		reader.bufs[i] = malloc(BLOCK_MAX);
+		if (reader.bufs[i] == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	rc = pthread_create(&reader.thread, NULL, read_blocks, cap);
+	if (rc != 0) {
+		fprintf(stderr, "can't start reading %s: %s\n", cap->path, strerror(rc));
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* read the whole not seekable capture in memory, after its already read head */
+static void slurp(struct capture *cap, const char *head, size_t szhead)
+{
+	size_t size = szhead, alloc = 1 << 20;
+	char *buf = malloc(alloc);
+	ssize_t rc;
+
+	if (buf != NULL && szhead != 0)
+		memcpy(buf, head, szhead);
+	for (;;) {
+		if (buf == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		if (size == alloc)
+			buf = realloc(buf, alloc <<= 1);
+		else {
+			rc = input(cap, &buf[size], alloc - size);
+			if (rc > 0)
+				size += (size_t)rc;
+			else if (rc == 0)
+				break;
+			else if (errno != EINTR) {
+				fprintf(stderr, "failed to read %s: %s\n", cap->path, strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+	cap->base = buf;
+	cap->size = size;
+	cap->body = &buf[szhead];
+	cap->mapped = false;
+}
+
+/* primes of XXH64 */
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t value, int count)
+{
+	return (value << count) | (value >> (64 - count));
+}
+
+static inline uint64_t read64(const uint8_t *ptr)
+{
+	uint64_t value;
+	memcpy(&value, ptr, sizeof value);
+	return le64toh(value);
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t input)
+{
+	return rotl64(acc + input * PRIME64_2, 31) * PRIME64_1;
+}
+
+static inline uint64_t merge64(uint64_t acc, uint64_t value)
+{
+	return (acc ^ round64(0, value)) * PRIME64_1 + PRIME64_4;
+}
+
+/* compute the 64 bits hash (XXH64) of the data of size with seed */
+uint64_t capture_hash(const void *data, size_t size, uint64_t seed)
+{
+	const uint8_t *ptr = data, *end = &ptr[size];
+	uint64_t h, v1, v2, v3, v4;
+	uint32_t v32;
+
+	/* stripes of 32 bytes */
+	if (size >= 32) {
+		v1 = seed + PRIME64_1 + PRIME64_2;
+		v2 = seed + PRIME64_2;
+		v3 = seed;
+		v4 = seed - PRIME64_1;
+		do {
+			v1 = round64(v1, read64(ptr));
+			v2 = round64(v2, read64(ptr + 8));
+			v3 = round64(v3, read64(ptr + 16));
+			v4 = round64(v4, read64(ptr + 24));
+			ptr += 32;
+		} while (end - ptr >= 32);
+		h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+		h = merge64(h, v1);
+		h = merge64(h, v2);
+		h = merge64(h, v3);
+		h = merge64(h, v4);
+	}
+	else
+		h = seed + PRIME64_5;
+	h += (uint64_t)size;
+
+	/* remaining bytes */
+	for ( ; end - ptr >= 8 ; ptr += 8)
+		h = rotl64(h ^ round64(0, read64(ptr)), 27) * PRIME64_1 + PRIME64_4;
+	if (end - ptr >= 4) {
+		memcpy(&v32, ptr, sizeof v32);
+		h = rotl64(h ^ (uint64_t)le32toh(v32) * PRIME64_1, 23) * PRIME64_2 + PRIME64_3;
+		ptr += 4;
+	}
+	for ( ; ptr < end ; ptr++)
+		h = rotl64(h ^ (uint64_t)*ptr * PRIME64_5, 11) * PRIME64_1;
+
+	/* avalanche */
+	h = (h ^ (h >> 33)) * PRIME64_2;
+	h = (h ^ (h >> 29)) * PRIME64_3;
+	return h ^ (h >> 32);
+}
+
+/* read the whole file of path, returns its content and its size */
+void *load_file(const char *path, size_t *size)
+{
+	struct capture file;
+
+	file.path = path;
+	file.fd = open(path, O_RDONLY);
+	if (file.fd < 0) {
+		fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	slurp(&file, NULL, 0);
+	close(file.fd);
+	*size = file.size;
+	return (void*)file.base;
+}
+
+/* set the file of the dictionary used to decompress captures */
+void capture_dictionary(const char *path)
+{
+	dictpath = path;
+}
+
+/* setup decompression of the container whose header is zhead,
+ * the compressed data is either in memory at src or read from the file */
+static void open_container(struct capture *cap, const char *zhead, const char *src, size_t size)
+{
+	void *dict = NULL;
+	size_t dictsz;
+	uint32_t method;
+
+	if (dictpath != NULL)
+		dict = load_file(dictpath, &dictsz);
+	/* the header may be unaligned */
+	memcpy(&method, &zhead[SEC_XATTR_CP_ID_LEN], sizeof method);
+	unz.method = le32toh(method);
+	unz.size = read64((const uint8_t*)&zhead[SEC_XATTR_CP_ID_LEN + 8]);
+	switch (unz.method) {
+#if WITH_ZSTD
+	case ZMETHOD_ZSTD:
+		unz.zstd = ZSTD_createDCtx();
+		if (unz.zstd == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		if (dict != NULL && ZSTD_isError(ZSTD_DCtx_loadDictionary(unz.zstd, dict, dictsz))) {
+			fprintf(stderr, "invalid dictionary %s\n", dictpath);
+			exit(EXIT_FAILURE);
+		}
+		break;
+#endif
+#if WITH_LZ4
+	case ZMETHOD_LZ4:
+		if (dict != NULL) {
+			fprintf(stderr, "no dictionary for lz4 compression of %s\n", cap->path);
+			exit(EXIT_FAILURE);
+		}
+		if (LZ4F_isError(LZ4F_createDecompressionContext(&unz.lz4, LZ4F_VERSION))) {
+			fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		break;
+#endif
+	default:
+		fprintf(stderr, "%s has unsupported compression %u\n", cap->path, (unsigned)unz.method);
+		exit(EXIT_FAILURE);
+	}
+	free(dict);
+
+	/* setup the compressed data */
+	unz.fd = cap->fd;
+	if (src != NULL) {
+		unz.src = src;
+		unz.srcsz = size;
+	}
+	else {
+		unz.buf = malloc(ZBUFSZ);
+		if (unz.buf == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+/* check the directory of the archive and select its last snapshot */
+static void open_archive(struct capture *cap)
+{
+	const uint32_t *ent;
+	uint32_t count = 0, idx, name, code, size;
+	size_t start;
+	bool valid;
+
+	valid = cap->size >= ARCHIVE_DIR;
+	if (valid) {
+		count = le32toh(*(const uint32_t*)&cap->base[ARCHIVE_DIR - sizeof(uint32_t)]);
+		valid = count != 0 && (cap->size - ARCHIVE_DIR) / SNAPSHOT_SIZE >= count;
+	}
+	start = ARCHIVE_DIR + (size_t)count * SNAPSHOT_SIZE;
+	for (idx = 0 ; valid && idx < count ; idx++) {
+		ent = (const uint32_t*)&cap->base[ARCHIVE_DIR + idx * SNAPSHOT_SIZE];
+		name = le32toh(ent[0]);
+		code = le32toh(ent[1]);
+		size = le32toh(ent[2]);
+		valid = name >= start && name < cap->size
+		     && memchr(&cap->base[name], 0, cap->size - name) != NULL
+		     && code >= start && (code & 3) == 0 && size != 0 && (size & 3) == 0
+		     && size <= cap->size - code;
+	}
+	if (!valid) {
+		fprintf(stderr, "%s is an invalid archive\n", cap->path);
+		exit(EXIT_FAILURE);
+	}
+	cap->snapshots = count;
+	capture_snapshot(cap, count - 1);
+}
+
+/* check the offsets of the classes and select the first class */
+static void open_classes(struct capture *cap)
+{
+	const uint32_t *offs = (const uint32_t*)&cap->base[CLASS_DIR];
+	uint32_t count = 0, idx, off;
+	size_t start;
+	bool valid;
+
+	valid = cap->size >= CLASS_DIR;
+	if (valid) {
+		count = le32toh(offs[-1]);
+		valid = count != 0 && count <= CLASS_MAX
+		     && (cap->size - CLASS_DIR) / sizeof(uint32_t) >= count;
+	}
+	start = CLASS_DIR + (size_t)count * sizeof(uint32_t);
+	for (idx = 0 ; valid && idx < count ; idx++) {
+		off = le32toh(offs[idx]);
+		valid = off >= start && (off & 3) == 0 && off < cap->size;
+	}
+	if (!valid) {
+		fprintf(stderr, "%s has invalid classes\n", cap->path);
+		exit(EXIT_FAILURE);
+	}
+	cap->classes = count;
+	capture_class(cap, 0);
+}
+
+/* report the invalid index of the capture */
+static void invalid_index(struct capture *cap)
+{
+	fprintf(stderr, "%s has an invalid index\n", cap->path);
+	exit(EXIT_FAILURE);
+}
+
+/* check the index and skip it in the header */
+static void open_index(struct capture *cap)
+{
+	size_t pos = SEC_XATTR_CP_ID_LEN + sizeof(uint32_t);
+	uint32_t off = 0, count = 0;
+	bool valid;
+
+	if (cap->flags & FLAG_CLASSES)
+		pos = CLASS_DIR + (size_t)cap->classes * sizeof(uint32_t);
+	valid = cap->size >= pos + 2 * sizeof(uint32_t);
+	if (valid) {
+		off = le32toh(*(const uint32_t*)&cap->base[pos]);
+		count = le32toh(*(const uint32_t*)&cap->base[pos + sizeof(uint32_t)]);
+		valid = count != 0 && (count & (count - 1)) == 0 && (off & 7) == 0
+		     && off >= pos + 2 * sizeof(uint32_t) && off <= cap->size
+		     && (cap->size - off) / INDEX_ENTRY >= count;
+	}
+	if (!valid)
+		invalid_index(cap);
+	cap->index = &cap->base[off];
+	cap->buckets = count;
+	if (!(cap->flags & FLAG_CLASSES))
+		cap->body = &cap->base[pos + 2 * sizeof(uint32_t)];
+}
+
+/* read the header of the capture being read, returns its size */
+static size_t read_head(struct capture *cap, char *head)
+{
+	size_t szhead;
+
+	if (!rdfull(cap, head, SEC_XATTR_CP_ID_LEN))
+		return 0;
+	szhead = SEC_XATTR_CP_ID_LEN;
+	if (memcmp(head, SEC_XATTR_CP_ID_V2, SEC_XATTR_CP_ID_LEN) == 0
+	 || memcmp(head, SEC_XATTR_CP_ID_A, SEC_XATTR_CP_ID_LEN) == 0) {
+		rdfull(cap, &head[szhead], sizeof(uint32_t));
+		szhead += sizeof(uint32_t);
+	}
+	return szhead;
+}
+
+/* open the capture of path ("-" for stdin) */
+void capture_open(struct capture *cap, const char *path)
+{
+	int rc;
+	struct stat st;
+	void *ptr;
+	char head[SEC_XATTR_CP_ID_LEN + sizeof(uint32_t)];
+	char zhead[ZHEAD_SIZE];
+	size_t szhead = 0;
+	bool reading, archive = false;
+
+	/* open the file */
+	cap->path = path;
+	cap->snapshots = 0;
+	cap->classes = 1;
+	cap->index = NULL;
+	cap->buckets = 0;
+	if (strcmp(path, "-") == 0)
+		cap->fd = 0;
+	else {
+		cap->fd = open(path, O_RDONLY);
+		if (cap->fd < 0) {
+			fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* gets its properties */
+	rc = fstat(cap->fd, &st);
+	if (rc < 0) {
+		fprintf(stderr, "failed to stat %s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	if ((st.st_mode & S_IFMT) == S_IFREG) {
+		/* map the regular file in memory */
+		ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, cap->fd, 0);
+		if (ptr == MAP_FAILED) {
+			fprintf(stderr, "failed to mmap %s: %s\n", path, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		close(cap->fd);
+		cap->fd = -1;
+		cap->base = ptr;
+		cap->size = (size_t)st.st_size;
+		cap->mapped = true;
+
+		/* decompress from memory if compressed */
+		reading = cap->size >= ZHEAD_SIZE
+			&& memcmp(cap->base, SEC_XATTR_CP_ID_Z, SEC_XATTR_CP_ID_LEN) == 0;
+		if (reading)
+			open_container(cap, cap->base, &cap->base[ZHEAD_SIZE], cap->size - ZHEAD_SIZE);
+	}
+	else {
+		/* read the ID of other files */
+		reading = true;
+		szhead = read_head(cap, head);
+		if (szhead == SEC_XATTR_CP_ID_LEN
+		 && memcmp(head, SEC_XATTR_CP_ID_Z, SEC_XATTR_CP_ID_LEN) == 0) {
+			/* decompress from the file if compressed */
+			memcpy(zhead, head, SEC_XATTR_CP_ID_LEN);
+			if (!rdfull(cap, &zhead[SEC_XATTR_CP_ID_LEN], ZHEAD_SIZE - SEC_XATTR_CP_ID_LEN)) {
+				fprintf(stderr, "%s is truncated\n", path);
+				exit(EXIT_FAILURE);
+			}
+			open_container(cap, zhead, NULL, 0);
+			szhead = 0;
+		}
+	}
+
+	/* read the header of not mapped captures */
+	if (reading) {
+		if (szhead == 0)
+			szhead = read_head(cap, head);
+		cap->base = head;
+		cap->size = szhead;
+	}
+
+	/* check header */
+	if (cap->size >= SEC_XATTR_CP_ID_LEN
+	 && memcmp(cap->base, SEC_XATTR_CP_ID_V1, SEC_XATTR_CP_ID_LEN) == 0) {
+		cap->flags = 0;
+		cap->body = &cap->base[SEC_XATTR_CP_ID_LEN];
+	}
+	else if (cap->size >= SEC_XATTR_CP_ID_LEN + sizeof(uint32_t)
+	 && memcmp(cap->base, SEC_XATTR_CP_ID_V2, SEC_XATTR_CP_ID_LEN) == 0) {
+		cap->flags = le32toh(*(const uint32_t*)&cap->base[SEC_XATTR_CP_ID_LEN]);
+		cap->body = &cap->base[SEC_XATTR_CP_ID_LEN + sizeof(uint32_t)];
+	}
+	else if (cap->size >= SEC_XATTR_CP_ID_LEN + sizeof(uint32_t)
+	 && memcmp(cap->base, SEC_XATTR_CP_ID_A, SEC_XATTR_CP_ID_LEN) == 0) {
+		cap->flags = le32toh(*(const uint32_t*)&cap->base[SEC_XATTR_CP_ID_LEN]);
+		cap->body = &cap->base[SEC_XATTR_CP_ID_LEN + sizeof(uint32_t)];
+		archive = true;
+	}
+	else {
+		fprintf(stderr, "%s isn't of expected format\n", path);
+		exit(EXIT_FAILURE);
+	}
+	if ((cap->flags & ~(FLAG_STREAM | FLAG_FRONT | FLAG_CLASSES | FLAG_INDEX)) != 0
+	 || (archive && (cap->flags & (FLAG_STREAM | FLAG_CLASSES | FLAG_INDEX)) != 0)
+	 || ((cap->flags & FLAG_STREAM) && (cap->flags & (FLAG_CLASSES | FLAG_INDEX)) != 0)) {
+		fprintf(stderr, "%s has unsupported flags %x\n", path, (unsigned)cap->flags);
+		exit(EXIT_FAILURE);
+	}
+
+	/* setup reading of not mapped captures */
+	if (reading) {
+		if (cap->flags & FLAG_STREAM) {
+			/* bounded memory, blocks are read while processed */
+			cap->base = cap->body = NULL;
+			cap->size = 0;
+			start_stream(cap);
+			return;
+		}
+		if (unz.size == 0 || unz.size < szhead || unz.size > SIZE_MAX) {
+			/* the whole capture is needed */
+			slurp(cap, head, szhead);
+		}
+		else {
+			/* decompress in a private mapping */
+			ptr = mmap(NULL, (size_t)unz.size, PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (ptr == MAP_FAILED) {
+				fprintf(stderr, "failed to mmap for %s: %s\n", path, strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+			memcpy(ptr, head, szhead);
+			if (unz.size > szhead && !rdfull(cap, &((char*)ptr)[szhead], (size_t)unz.size - szhead)) {
+				fprintf(stderr, "%s is truncated\n", path);
+				exit(EXIT_FAILURE);
+			}
+			cap->base = ptr;
+			cap->size = (size_t)unz.size;
+			cap->body = &cap->base[szhead];
+			cap->mapped = true;
+		}
+		if (cap->fd >= 0)
+			close(cap->fd);
+		cap->fd = -1;
+	}
+
+	/* check the directory of archives */
+	if (archive)
+		open_archive(cap);
+	if (cap->flags & FLAG_CLASSES)
+		open_classes(cap);
+	if (cap->flags & FLAG_INDEX)
+		open_index(cap);
+}
+
+/* select the codes of the priority class of index idx */
+void capture_class(struct capture *cap, uint32_t idx)
+{
+	if (cap->flags & FLAG_CLASSES)
+		cap->body = &cap->base[le32toh(((const uint32_t*)&cap->base[CLASS_DIR])[idx])];
+}
+
+/* select the snapshot of index idx of the archive and return its name */
+const char *capture_snapshot(struct capture *cap, uint32_t idx)
+{
+	const uint32_t *ent = (const uint32_t*)&cap->base[ARCHIVE_DIR + idx * SNAPSHOT_SIZE];
+
+	cap->body = &cap->base[le32toh(ent[1])];
+	return &cap->base[le32toh(ent[0])];
+}
+
+/* select the snapshot of name of the archive */
+void capture_select(struct capture *cap, const char *name)
+{
+	uint32_t idx;
+
+	for (idx = 0 ; idx < cap->snapshots ; idx++)
+		if (strcmp(capture_snapshot(cap, idx), name) == 0)
+			return;
+	fprintf(stderr, "no snapshot %s in %s\n", name, cap->path);
+	exit(EXIT_FAILURE);
+}
+
+/* call fun for the attributes of the file of path, relative to the root and
+ * starting with a slash, searched in the index, returns their count */
+int capture_lookup(struct capture *cap, const char *path,
+		void (*fun)(void *closure, const char *attr, const char *value, size_t size),
+		void *closure)
+{
+	const char *ent, *str, *name, *attr;
+	const uint32_t *pcode, *end;
+	uint64_t hash;
+	uint32_t slot, probes, off, code;
+	size_t pre, len;
+	int count = 0;
+
+	if (cap->index == NULL) {
+		fprintf(stderr, "%s has no index\n", cap->path);
+		exit(EXIT_FAILURE);
+	}
+
+	/* the name of the file, the root being named "." */
+	name = strrchr(path, '/');
+	name = name == NULL ? path : &name[1];
+	if (*name == 0)
+		name = ".";
+
+	/* search the bucket of the path */
+	hash = capture_hash(path, strlen(path), 0);
+	slot = (uint32_t)hash;
+	for (probes = 0 ; ; probes++, slot++) {
+		if (probes == cap->buckets)
+			return 0;
+		ent = &cap->index[(slot & (cap->buckets - 1)) * INDEX_ENTRY];
+		off = le32toh(*(const uint32_t*)&ent[8]);
+		if (off == 0)
+			return 0;
+		if (le64toh(*(const uint64_t*)ent) != hash)
+			continue;
+
+		/* check the name of the FILE code */
+		if ((off & 3) != 0 || off > cap->size - 2 * sizeof(uint32_t))
+			invalid_index(cap);
+		pcode = (const uint32_t*)&cap->base[off];
+		code = le32toh(*pcode++);
+		str = &((const char*)pcode)[code >> TAG_WIDTH];
+		if ((code & TAG_MASK) != TAG_FILE || (size_t)(str - cap->base) >= cap->size)
+			invalid_index(cap);
+		if (!(cap->flags & FLAG_FRONT) ? strcmp(str, name) == 0
+		 : (pre = (size_t)(uint8_t)str[0]) <= strlen(name) && strcmp(&str[1], &name[pre]) == 0)
+			break;
+	}
+
+	/* the attributes of the file, up to the next name */
+	off = le32toh(*(const uint32_t*)&ent[12]);
+	attr = off == 0 || off >= cap->size ? NULL : &cap->base[off];
+	end = (const uint32_t*)&cap->base[cap->size & ~(size_t)3];
+	while (pcode < end) {
+		code = le32toh(*pcode++);
+		str = &((const char*)pcode)[code >> TAG_WIDTH];
+		if ((code & TAG_MASK) == TAG_ATTR)
+			attr = str;
+		else if ((code & TAG_MASK) != TAG_SET)
+			break;
+		else if (attr == NULL || (size_t)(str - cap->base) > cap->size - 2)
+			invalid_index(cap);
+		else {
+			/* the value must be in the capture */
+			len = ((size_t)(uint8_t)str[0]) | (((size_t)(uint8_t)str[1]) << 8);
+			if (len > cap->size - 2 - (size_t)(str - cap->base))
+				invalid_index(cap);
+			fun(closure, attr, &str[2], len);
+			count++;
+		}
+	}
+	if (count == 0)
+		invalid_index(cap);
+	return count;
+}
+
+/* close the capture and release its resources */
+void capture_close(struct capture *cap)
+{
+	int i;
+
+	if (cap->base == NULL) {
+		/* stop the reader of the stream */
+		pthread_cancel(reader.thread);
+		pthread_join(reader.thread, NULL);
+		for (i = 0 ; i < NBUFS ; i++)
+			free(reader.bufs[i]);
+		reader.produced = reader.consumed = 0;
+		reader.held = reader.ended = false;
+	}
+	else if (cap->mapped)
+		munmap((void*)cap->base, cap->size);
+	else
+		free((void*)cap->base);
+	if (cap->fd >= 0)
+		close(cap->fd);
+	cap->fd = -1;
+
+	/* release the decompression */
+	switch (unz.method) {
+#if WITH_ZSTD
+	case ZMETHOD_ZSTD:
+		ZSTD_freeDCtx(unz.zstd);
+		break;
+#endif
+#if WITH_LZ4
+	case ZMETHOD_LZ4:
+		LZ4F_freeDecompressionContext(unz.lz4);
+		break;
+#endif
+	}
+	if (unz.method != 0 && unz.fd < 0)
+		munmap((void*)&unz.src[-ZHEAD_SIZE], unz.srcsz + ZHEAD_SIZE);
+	free(unz.buf);
+	memset(&unz, 0, sizeof unz);
+}
+
+/* get the next block of a capture of the stream variant
+ * or NULL at its end, the previous block is released */
+const char *capture_block(struct capture *cap)
+{
+	const char *result;
+	size_t sz;
+
+	if (cap->base != NULL) {
+		/* in memory, the body is advanced block by block */
+		sz = (size_t)(&cap->base[cap->size] - cap->body);
+		if (sz == 0)
+			return NULL;
+		result = cap->body;
+		if (sz < BLOCK_HEAD || block_size(cap, result) > sz) {
+			fprintf(stderr, "%s is truncated\n", cap->path);
+			exit(EXIT_FAILURE);
+		}
+		check_strings(cap, result);
+		cap->body += block_size(cap, result);
+		return result;
+	}
+
+	/* streamed, get the block produced by the reader */
+	pthread_mutex_lock(&reader.mutex);
+	if (reader.held) {
+		reader.consumed++;
+		pthread_cond_signal(&reader.cond);
+	}
+	while (reader.produced == reader.consumed && !reader.ended)
+		pthread_cond_wait(&reader.cond, &reader.mutex);
+	reader.held = reader.produced != reader.consumed;
+	result = reader.held ? reader.bufs[reader.consumed % NBUFS] : NULL;
+	pthread_mutex_unlock(&reader.mutex);
+	return result;
+}
+
+/* return the string of the code, not an END, of the block blk of the stream
+ * variant, checked to be in the strings of the block with its value */
+const char *capture_block_string(struct capture *cap, const char *blk, uint32_t code)
+{
+	uint32_t strsz = le32toh(((const uint32_t*)blk)[0]);
+	uint32_t off = code >> TAG_WIDTH;
+	size_t len;
+
+	if (off < BLOCK_HEAD || off >= BLOCK_HEAD + strsz) {
+		fprintf(stderr, "%s has an invalid code\n", cap->path);
+		exit(EXIT_FAILURE);
+	}
+	if ((code & TAG_MASK) == TAG_SET) {
+		len = off + 2 > BLOCK_HEAD + strsz ? BLOCK_MAX
+			: ((size_t)(uint8_t)blk[off]) | (((size_t)(uint8_t)blk[off + 1]) << 8);
+		if (off + 2 + len > BLOCK_HEAD + strsz) {
+			fprintf(stderr, "%s has an invalid code\n", cap->path);
+			exit(EXIT_FAILURE);
+		}
+	}
+	return &blk[off];
+}
+
+/* pool of strings, per thread */
+__thread struct recstr *recstrs = NULL;
+__thread struct recstr **strtail = NULL;
+__thread struct recstr **strtab = NULL;
+__thread size_t strtabsz = 0;
+__thread size_t strcount = 0;
+
+/* give to fun the bytes of str escaped with backslashes for TSV or,
+ * if json, for a JSON string */
+void escape(const char *str, size_t len, bool json,
+		void (*fun)(const char *str, size_t len))
+{
+	static const char hex[] = "0123456789abcdef";
+	char esc[6];
+	size_t idx, beg = 0, elen;
+	uint8_t c;
+
+	for (idx = 0 ; idx < len ; idx++) {
+		c = (uint8_t)str[idx];
+		if (c >= 0x20 && c != 0x7f && c != '\\' && (!json || (c != '"' && c < 0x80)))
+			continue;
+		fun(&str[beg], idx - beg);
+		beg = idx + 1;
+		esc[0] = '\\';
+		elen = 2;
+		if (c == '\\' || c == '"')
+			esc[1] = (char)c;
+		else if (c == '\t')
+			esc[1] = 't';
+		else if (c == '\n')
+			esc[1] = 'n';
+		else if (json) {
+			memcpy(&esc[1], "u00", 3);
+			esc[4] = hex[c >> 4];
+			esc[5] = hex[c & 15];
+			elen = 6;
+		}
+		else {
+			esc[1] = (char)('0' + (c >> 6));
+			esc[2] = (char)('0' + ((c >> 3) & 7));
+			esc[3] = (char)('0' + (c & 7));
+			elen = 4;
+		}
+		fun(esc, elen);
+	}
+	fun(&str[beg], len - beg);
+}
+
+/* allocation of memory */
+void *alloc(size_t sz)
+{
+	void *result = malloc(sz);
+	if (result == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	return result;
+}
+
+/* return the string record for the given string */
+struct recstr *addstr(const char *value, size_t sz)
+{
+	struct recstr *iter, *nxt, **slots;
+	size_t idx, hash = 14695981039346656037UL; /* FNV-1a */
+
+	/* hash */
+	for (idx = 0 ; idx < sz ; idx++)
+		hash = (hash ^ (size_t)(uint8_t)value[idx]) * 1099511628211UL;
+
+	/* grow the hash table on need */
+	if (strcount >= strtabsz) {
+		idx = strtabsz ? strtabsz << 1 : 4096;
+		slots = alloc(idx * sizeof *slots);
+		memset(slots, 0, idx * sizeof *slots);
+		while (strtabsz > 0) {
+			for (iter = strtab[--strtabsz] ; iter != NULL ; iter = nxt) {
+				nxt = iter->hnxt;
+				iter->hnxt = slots[iter->hash & (idx - 1)];
+				slots[iter->hash & (idx - 1)] = iter;
+			}
+		}
+		free(strtab);
+		strtab = slots;
+		strtabsz = idx;
+	}
+
+	/* search */
+	iter = strtab[hash & (strtabsz - 1)];
+	while (iter != NULL && !(iter->hash == hash && iter->size == sz && 0 == memcmp(value, iter->value, sz)))
+		iter = iter->hnxt;
+	if (iter == NULL) {
+		/* create if not found */
+		iter = alloc(sz + sizeof *iter);
+		iter->size = sz;
+		memcpy(iter->value, value, sz);
+		iter->nxt = NULL;
+		iter->hash = hash;
+		iter->hnxt = strtab[hash & (strtabsz - 1)];
+		strtab[hash & (strtabsz - 1)] = iter;
+		iter->offset = 0;
+		iter->block = 0;
+		iter->used = false;
+		if (strtail == NULL)
+			strtail = &recstrs;
+		*strtail = iter;
+		strtail = &iter->nxt;
+		strcount++;
+	}
+	return iter;
+}
+
+/* return the string for name front coded after the name prev */
+struct recstr *frontstr(struct recstr *prev, struct recstr *name)
+{
+	char buffer[NAME_MAX + 2];
+	size_t pre = 0, len = name->size;
+
+	if (prev != NULL) {
+		while (pre < UINT8_MAX && pre + 1 < len && pre + 1 < prev->size
+		    && prev->value[pre] == name->value[pre])
+			pre++;
+	}
+	if (len - pre + 1 > sizeof buffer) {
+		fprintf(stderr, "name too long %s\n", name->value);
+		exit(EXIT_FAILURE);
+	}
+	buffer[0] = (char)(uint8_t)pre;
+	memcpy(&buffer[1], &name->value[pre], len - pre);
+	return addstr(buffer, len - pre + 1);
+}
@@ -23,6 +23,45 @@
 
 
 #define SEC_XATTR_CP_ID_V1 "sec-xattr-cp 1\n\n"
+#define SEC_XATTR_CP_ID_V2 "sec-xattr-cp 2\n\n"
+#define SEC_XATTR_CP_ID_Z  "sec-xattr-cp z\n\n"
+#define SEC_XATTR_CP_ID_A  "sec-xattr-cp a\n\n"
+#define SEC_XATTR_CP_ID_LEN 16
+
+/* the compressed container starts with the ID Z followed by
+ * the 32 bits method, 32 bits zero and the 64 bits uncompressed size */
+#define ZHEAD_SIZE  32
+#define ZMETHOD_ZSTD 1
+#define ZMETHOD_LZ4  2
+
+/* flags of the version 2, recorded after the ID */
+#define FLAG_STREAM 1
+#define FLAG_FRONT  2
+#define FLAG_CLASSES 4
+#define FLAG_INDEX  8
+
+/* with the flag CLASSES, the flags are followed by the count of priority
+ * classes, at most CLASS_MAX, and by the 32 bits offsets in the file of
+ * the codes of each class */
+#define CLASS_MAX 32
+
+/* with the flag INDEX, the header ends with the 32 bits offset of the index
+ * and its count of buckets, a power of 2; each bucket of INDEX_ENTRY bytes
+ * is made of the 64 bits hash (XXH64) of the path of a file, relative to the
+ * root and starting with a slash, the 32 bits offset of its FILE code, or 0
+ * for an empty bucket, and the 32 bits offset of the attribute set before */
+#define INDEX_ENTRY 16
+
+/* the archive starts with the ID A, the flags and the count of
+ * snapshots, followed by the directory of SNAPSHOT_SIZE bytes entries
+ * made of the 32 bits offsets of the name and of the code and the 32 bits
+ * size of the code, then the codes of the snapshots and the strings */
+#define SNAPSHOT_SIZE 12
+
+/* the stream variant is made of blocks of at most BLOCK_MAX bytes
+ * starting with a header of BLOCK_HEAD bytes */
+#define BLOCK_MAX  (1 << 17)
+#define BLOCK_HEAD 8
 
 #define TAG_WIDTH 2
 #define TAG_MASK  ((1 << TAG_WIDTH) - 1)
@@ -31,3 +70,91 @@
 #define TAG_ATTR  2
 #define TAG_SET   3
 
+
+/* a capture file opened for reading */
+struct capture {
+	const char *path;    /* path of the file */
+	const char *base;    /* content in memory, starting with the ID */
+	size_t size;         /* size of the content in memory */
+	uint32_t flags;      /* flags of the capture, 0 for version 1 */
+	const char *body;    /* start of the body after ID and flags */
+	int fd;              /* file descriptor of a streamed capture or -1 */
+	bool mapped;         /* is the content mapped or allocated */
+	uint32_t snapshots;  /* count of snapshots of an archive or 0 */
+	uint32_t classes;    /* count of priority classes, at least 1 */
+	const char *index;   /* the buckets of the index or NULL */
+	uint32_t buckets;    /* count of buckets of the index */
+};
+
+/* compute the 64 bits hash (XXH64) of the data of size with seed */
+extern uint64_t capture_hash(const void *data, size_t size, uint64_t seed);
+
+/* read the whole file of path, returns its content and its size */
+extern void *load_file(const char *path, size_t *size);
+
+/* set the file of the dictionary used to decompress captures */
+extern void capture_dictionary(const char *path);
+
+/* open the capture of path ("-" for stdin) */
+extern void capture_open(struct capture *cap, const char *path);
+
+/* select the snapshot of index idx of the archive and return its name */
+extern const char *capture_snapshot(struct capture *cap, uint32_t idx);
+
+/* select the snapshot of name of the archive */
+extern void capture_select(struct capture *cap, const char *name);
+
+/* select the codes of the priority class of index idx */
+extern void capture_class(struct capture *cap, uint32_t idx);
+
+/* call fun for the attributes of the file of path, relative to the root and
+ * starting with a slash, searched in the index, returns their count */
+extern int capture_lookup(struct capture *cap, const char *path,
+		void (*fun)(void *closure, const char *attr, const char *value, size_t size),
+		void *closure);
+
+/* close the capture and release its resources */
+extern void capture_close(struct capture *cap);
+
+/* get the next block of a capture of the stream variant
+ * or NULL at its end, the previous block is released */
+extern const char *capture_block(struct capture *cap);
+
+/* return the string of the code, not an END, of the block blk of the stream
+ * variant, checked to be in the strings of the block with its value */
+extern const char *capture_block_string(struct capture *cap, const char *blk, uint32_t code);
+
+/* give to fun the bytes of str escaped with backslashes for TSV or,
+ * if json, for a JSON string */
+extern void escape(const char *str, size_t len, bool json,
+		void (*fun)(const char *str, size_t len));
+
+/* record a string of a pool */
+struct recstr {
+	size_t size;        /* size of the string without zero */
+	struct recstr *nxt; /* next string record */
+	struct recstr *hnxt;/* next string record of same hash slot */
+	size_t hash;        /* hash of the string */
+	size_t offset;      /* final offset in file or in block */
+	unsigned block;     /* last block holding the string (stream variant) */
+	bool used;          /* is the string used by operations */
+	char value[];       /* the string terminated with a zero */
+};
+
+/* the pool of strings of the current thread: list of the strings, its
+ * last link (NULL before the first string) and hash table, its size being
+ * a power of 2 */
+extern __thread struct recstr *recstrs;
+extern __thread struct recstr **strtail;
+extern __thread struct recstr **strtab;
+extern __thread size_t strtabsz;
+extern __thread size_t strcount;
+
+/* allocate sz bytes, exit on failure */
+extern void *alloc(size_t sz);
+
+/* return the string record of the pool for the given string of size sz */
+extern struct recstr *addstr(const char *value, size_t sz);
+
+/* return the string for name front coded after the name prev */
+extern struct recstr *frontstr(struct recstr *prev, struct recstr *name);
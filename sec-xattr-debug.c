@@ -23,6 +23,7 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <fcntl.h>
@@ -52,6 +53,54 @@ char spaces[] = "                              "
 
 char path[PATH_MAX];
 
+/* are the names front coded */
+bool front = false;
+
+/* kind of output */
+#define OUT_DUMP  0
+#define OUT_STATS 1
+#define OUT_TSV   2
+#define OUT_JSON  3
+int output = OUT_DUMP;
+
+/* buffer of the output of exports */
+char outbuf[1 << 20];
+size_t outlen = 0;
+
+/* bit set of the strings already seen */
+uint8_t *seen;
+
+/* statistics of the capture */
+struct {
+	size_t ops[5];       /* count of SUB, FILE, ATTR, SET and END */
+	size_t refs;         /* count of references to strings */
+	size_t distinct;     /* count of distinct strings referenced */
+	size_t strbytes;     /* size of the distinct strings referenced */
+	size_t values[17];   /* count of values by size, power of 2 buckets */
+	size_t perfile[17];  /* count of files by count of attributes, last is 16 and more */
+	unsigned maxdepth;   /* maximum depth of directories */
+	size_t blocks;       /* count of blocks of the stream variant */
+	size_t head;         /* size of the headers of file and blocks */
+	size_t code;         /* size of the codes */
+	size_t strings;      /* size of the strings */
+	size_t index;        /* size of the index */
+	size_t others;       /* size of the codes of the other snapshots of an archive */
+} stats;
+
+/* put in path at offset the name front coded in str, returns its length */
+size_t frontname(size_t offset, const char *str)
+{
+	size_t pre = (size_t)(uint8_t)str[0];
+	size_t len = strlen(&str[1]) + 1;
+
+	if (offset + pre + len > sizeof path) {
+		fprintf(stderr, "path too long %.*s%s\n", (int)(offset + pre), path, &str[1]);
+		exit(EXIT_FAILURE);
+	}
+	memcpy(&path[offset + pre], &str[1], len);
+	return pre + len - 1;
+}
+
 void *process(uint32_t *pcode, unsigned depth, size_t offset, const char *subpath)
 {
 	static const char *attr = NULL;
@@ -96,10 +145,22 @@ void *process(uint32_t *pcode, unsigned depth, size_t offset, const char *subpat
 				printf("END\n");
 				return pcode;
 			}
+			if (front) {
+				printf("SUB %d=%d [%d]%s\n", off, dep, (int)(uint8_t)str[0], &str[1]);
+				pcode = process(pcode, depth + 1, offset + frontname(offset, str), "");
+				break;
+			}
 			printf("SUB %d=%d %s\n", off, dep, str);
 			pcode = process(pcode, depth + 1, offset, str);
 			break;
 		case TAG_FILE:
+			if (front) {
+				frontname(offset, str);
+				printf("FILE %d=%d [%d]%s\n", off, dep, (int)(uint8_t)str[0], &str[1]);
+				printf("       %.*s", 3*depth, spaces);
+				printf("  -> %s\n", path);
+				break;
+			}
 			len = strlen(str) + 1;
 			if (offset + len > sizeof path) {
 				fprintf(stderr, "path too long %.*s%s\n", (int)offset, path, offset);
@@ -126,67 +187,403 @@ void *process(uint32_t *pcode, unsigned depth, size_t offset, const char *subpat
 	}
 }
 
-/*
- * Opens the file 'path' and map it in memory.
- * Returns the position in memory
- */
-void *mapin(const char *path)
+/* write the buffered output */
+void flush()
 {
-	int rc, fd;
-	struct stat st;
-	void *ptr;
+	size_t pos = 0;
+	ssize_t rc;
 
-	/* open the file */
-	fd = open(path, O_RDONLY);
-	if (fd < 0) {
-		fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
-		exit(EXIT_FAILURE);
+	while (pos < outlen) {
+		rc = write(1, &outbuf[pos], outlen - pos);
+		if (rc < 0 && errno != EINTR) {
+			fprintf(stderr, "write error: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		if (rc > 0)
+			pos += (size_t)rc;
 	}
+	outlen = 0;
+}
 
-	/* gets its properties */
-	rc = fstat(fd, &st);
-	if (rc < 0) {
-		fprintf(stderr, "failed to stat %s: %s\n", path, strerror(errno));
-		exit(EXIT_FAILURE);
+/* output the bytes */
+void out(const char *str, size_t len)
+{
+	if (outlen + len > sizeof outbuf)
+		flush();
+	memcpy(&outbuf[outlen], str, len);
+	outlen += len;
+}
+
+/* output the bytes escaped for TSV or JSON */
+void outesc(const char *str, size_t len)
+{
+	escape(str, len, output == OUT_JSON, out);
+}
+
+/* export the value of the attribute of the file of path */
+void export(size_t pathlen, const char *attr, const char *value, size_t len)
+{
+	if (output == OUT_JSON) {
+		if (stats.ops[TAG_SET] > 1)
+			out(",\n", 2);
+		out("{\"path\":\"", 9);
+		outesc(path, pathlen);
+		out("\",\"attr\":\"", 10);
+		outesc(attr, strlen(attr));
+		out("\",\"value\":\"", 11);
+		outesc(value, len);
+		out("\"}", 2);
 	}
+	else {
+		outesc(path, pathlen);
+		out("\t", 1);
+		outesc(attr, strlen(attr));
+		out("\t", 1);
+		outesc(value, len);
+		out("\n", 1);
+	}
+}
+
+/* put in path at offset the name of str, returns its length */
+size_t putname(size_t offset, const char *str)
+{
+	size_t len;
 
-	/* check it is a regular file */
-	if ((st.st_mode & S_IFMT) != S_IFREG) {
-		fprintf(stderr, "%s should be a regular file\n", path);
+	if (front)
+		return frontname(offset, str);
+	len = strlen(str) + 1;
+	if (offset + len > sizeof path) {
+		fprintf(stderr, "path too long %.*s%s\n", (int)offset, path, str);
 		exit(EXIT_FAILURE);
 	}
+	memcpy(&path[offset], str, len);
+	return len - 1;
+}
 
-	/* map the regular file in memory */
-	ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (ptr == MAP_FAILED) {
-		fprintf(stderr, "failed to mmap %s: %s\n", path, strerror(errno));
-		exit(EXIT_FAILURE);
+/* index of the power of 2 bucket of value */
+unsigned bucket(size_t value)
+{
+	unsigned idx = 0;
+	while (value != 0) {
+		value >>= 1;
+		idx++;
 	}
+	return idx;
+}
+
+/* print the statistics */
+void print_stats()
+{
+	static const char *names[5] = { "SUB", "FILE", "ATTR", "SET", "END" };
+	unsigned idx;
+
+	printf("bytes header %lu\n", (unsigned long)stats.head);
+	printf("bytes code %lu\n", (unsigned long)stats.code);
+	printf("bytes strings %lu\n", (unsigned long)stats.strings);
+	if (stats.index != 0)
+		printf("bytes index %lu\n", (unsigned long)stats.index);
+	if (stats.others != 0)
+		printf("bytes other-snapshots %lu\n", (unsigned long)stats.others);
+	if (stats.blocks != 0)
+		printf("blocks %lu\n", (unsigned long)stats.blocks);
+	for (idx = 0 ; idx < 5 ; idx++)
+		printf("ops %s %lu\n", names[idx], (unsigned long)stats.ops[idx]);
+	printf("strings refs %lu distinct %lu bytes %lu reuse %.2f\n",
+		(unsigned long)stats.refs, (unsigned long)stats.distinct, (unsigned long)stats.strbytes,
+		stats.distinct ? (double)stats.refs / (double)stats.distinct : 0.0);
+	printf("depth max %u\n", stats.maxdepth);
+	for (idx = 0 ; idx < 17 ; idx++)
+		if (stats.values[idx] != 0) {
+			if (idx < 2)
+				printf("value-size %u %lu\n", idx, (unsigned long)stats.values[idx]);
+			else
+				printf("value-size %lu-%lu %lu\n", 1UL << (idx - 1), (2UL << (idx - 1)) - 1,
+					(unsigned long)stats.values[idx]);
+		}
+	for (idx = 0 ; idx < 17 ; idx++)
+		if (stats.perfile[idx] != 0)
+			printf("attrs-per-file %u%s %lu\n", idx, idx == 16 ? "+" : "",
+					(unsigned long)stats.perfile[idx]);
+}
 
-	/* check header */
-	if (memcmp(ptr, SEC_XATTR_CP_ID_V1, strlen(SEC_XATTR_CP_ID_V1)) != 0) {
-		fprintf(stderr, "%s isn't of expected format\n", path);
+/* compute statistics or export the capture in one linear pass */
+void analyze(struct capture *cap, const char *root)
+{
+	static size_t stack[PATH_MAX / 2];
+	const char *blk = NULL, *str, *attr = NULL;
+	const uint32_t *pcode, *end, *ent;
+	uint32_t code, strsz, codesz, idx;
+	size_t offset, pathlen = 0, stroff, len, nattr = 0, codend;
+	unsigned depth = 0, tag, class = 0;
+	bool infile = false, streamed = (cap->flags & FLAG_STREAM) != 0;
+
+	/* start at root */
+	offset = strlen(root);
+	if (offset + 1 >= sizeof path) {
+		fprintf(stderr, "path too long %s\n", root);
 		exit(EXIT_FAILURE);
 	}
+	memcpy(path, root, offset);
+	if (offset == 0 || path[offset - 1] != '/')
+		path[offset++] = '/';
+	if (streamed) {
+		seen = calloc(BLOCK_MAX / 8, 1);
+		pcode = end = NULL;
+	}
+	else {
+		seen = calloc(cap->size / 8 + 1, 1);
+		stats.head = (size_t)(cap->body - cap->base);
+		pcode = (const uint32_t*)cap->body;
+		end = (const uint32_t*)&cap->base[cap->size & ~(size_t)3];
+	}
+	if (seen == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (;;) {
+		/* get the code */
+		if (pcode >= end) {
+			if (!streamed || (blk = capture_block(cap)) == NULL) {
+				fprintf(stderr, "truncated capture %s\n", cap->path);
+				exit(EXIT_FAILURE);
+			}
+			strsz = le32toh(((const uint32_t*)blk)[0]);
+			codesz = le32toh(((const uint32_t*)blk)[1]);
+			pcode = (const uint32_t*)&blk[BLOCK_HEAD + strsz];
+			end = (const uint32_t*)&blk[BLOCK_HEAD + strsz + codesz];
+			stats.blocks++;
+			stats.head += BLOCK_HEAD;
+			stats.strings += strsz;
+			stats.code += codesz;
+			memset(seen, 0, BLOCK_MAX / 8);
+		}
+		code = le32toh(*pcode++);
+		tag = code == TAG_SUB ? 4 : code & TAG_MASK;
+		stats.ops[tag]++;
+
+		/* end of a file */
+		if (infile && tag != TAG_ATTR && tag != TAG_SET) {
+			stats.perfile[nattr < 16 ? nattr : 16]++;
+			infile = false;
+		}
+
+		/* end of a directory */
+		if (tag == 4) {
+			if (depth == 0 && ++class < cap->classes) {
+				/* next priority class */
+				capture_class(cap, class);
+				pcode = (const uint32_t*)cap->body;
+				continue;
+			}
+			if (depth == 0)
+				break;
+			offset = stack[--depth];
+			continue;
+		}
+
+		/* the string */
+		if (streamed) {
+			str = capture_block_string(cap, blk, code);
+			stroff = (size_t)(str - blk);
+		}
+		else {
+			str = &((const char*)pcode)[code >> TAG_WIDTH];
+			stroff = (size_t)(str - cap->base);
+			if (stroff >= cap->size || (tag == TAG_SET && stroff + 2 > cap->size)) {
+				fprintf(stderr, "invalid capture %s\n", cap->path);
+				exit(EXIT_FAILURE);
+			}
+		}
+		len = tag != TAG_SET ? 0 : ((size_t)(uint8_t)str[0]) | (((size_t)(uint8_t)str[1]) << 8);
+		if (!streamed && tag == TAG_SET && stroff + 2 + len > cap->size) {
+			fprintf(stderr, "invalid capture %s\n", cap->path);
+			exit(EXIT_FAILURE);
+		}
+		stats.refs++;
+		if (!(seen[stroff >> 3] & (1 << (stroff & 7)))) {
+			seen[stroff >> 3] |= (uint8_t)(1 << (stroff & 7));
+			stats.distinct++;
+			stats.strbytes += tag == TAG_SET ? len + 2
+					: tag != TAG_ATTR && front ? strlen(&str[1]) + 2 : strlen(str) + 1;
+		}
+
+		/* the operation */
+		switch (tag) {
+		case TAG_SUB:
+			if (depth == sizeof stack / sizeof *stack) {
+				fprintf(stderr, "too deep %s\n", path);
+				exit(EXIT_FAILURE);
+			}
+			stack[depth++] = offset;
+			if (depth > stats.maxdepth)
+				stats.maxdepth = depth;
+			offset += putname(offset, str);
+			if (offset + 1 >= sizeof path) {
+				fprintf(stderr, "path too long %s\n", path);
+				exit(EXIT_FAILURE);
+			}
+			path[offset++] = '/';
+			break;
+		case TAG_FILE:
+			pathlen = offset + putname(offset, str);
+			infile = true;
+			nattr = 0;
+			break;
+		case TAG_ATTR:
+			attr = str;
+			break;
+		case TAG_SET:
+			if (attr == NULL) {
+				fprintf(stderr, "invalid capture %s\n", cap->path);
+				exit(EXIT_FAILURE);
+			}
+			nattr++;
+			stats.values[bucket(len)]++;
+			if (output != OUT_STATS)
+				export(pathlen, attr, &str[2], len);
+			break;
+		}
+	}
+
+	/* sizes of the sections */
+	if (streamed)
+		stats.head += SEC_XATTR_CP_ID_LEN + sizeof(uint32_t);
+	else if (cap->snapshots != 0) {
+		/* the directory, the codes of the snapshots and the shared strings */
+		stats.head = SEC_XATTR_CP_ID_LEN + 2 * sizeof(uint32_t) + cap->snapshots * SNAPSHOT_SIZE;
+		stats.code = (size_t)((const char*)pcode - cap->body);
+		codend = stats.head;
+		for (idx = 0 ; idx < cap->snapshots ; idx++) {
+			ent = (const uint32_t*)&cap->base[SEC_XATTR_CP_ID_LEN + 2 * sizeof(uint32_t) + idx * SNAPSHOT_SIZE];
+			if (le32toh(ent[1]) + le32toh(ent[2]) > codend)
+				codend = le32toh(ent[1]) + le32toh(ent[2]);
+		}
+		stats.others = codend - stats.head - stats.code;
+		stats.strings = cap->size - codend;
+	}
+	else {
+		stats.code = (size_t)((const char*)pcode - &cap->base[stats.head]);
+		stats.index = cap->index == NULL ? 0 : cap->size - (size_t)(cap->index - cap->base);
+		stats.strings = cap->size - stats.head - stats.code - stats.index;
+	}
+}
 
-	/* return the values */
-	return (void*)(((char*)ptr) + strlen(SEC_XATTR_CP_ID_V1));
+void stream(struct capture *cap, const char *root)
+{
+	const char *blk, *str;
+	const uint32_t *pcode, *end;
+	uint32_t code, strsz, codesz;
+	unsigned depth = 0, nblk = 0;
+	int off;
+	size_t len;
+
+	printf("ENTERING %s\n", root);
+	while ((blk = capture_block(cap)) != NULL) {
+		strsz = le32toh(((const uint32_t*)blk)[0]);
+		codesz = le32toh(((const uint32_t*)blk)[1]);
+		printf("BLOCK %u strings %u codes %u\n", nblk++, (unsigned)strsz, (unsigned)codesz);
+		pcode = (const uint32_t*)&blk[BLOCK_HEAD + strsz];
+		end = (const uint32_t*)&blk[BLOCK_HEAD + strsz + codesz];
+		while (pcode < end) {
+			printf("%06d %.*s", (int)((const char*)pcode - blk), 3*depth, spaces);
+			code = le32toh(*pcode++);
+			off = (int)(code >> TAG_WIDTH);
+			str = code == TAG_SUB ? NULL : capture_block_string(cap, blk, code);
+			switch (code & TAG_MASK) {
+			case TAG_SUB:
+				if (code == TAG_SUB) {
+					printf("END\n");
+					if (depth == 0)
+						return;
+					depth--;
+				}
+				else if (front) {
+					printf("SUB %d [%d]%s\n", off, (int)(uint8_t)str[0], &str[1]);
+					depth += depth < 100;
+				}
+				else {
+					printf("SUB %d %s\n", off, str);
+					depth += depth < 100;
+				}
+				break;
+			case TAG_FILE:
+				if (front)
+					printf("FILE %d [%d]%s\n", off, (int)(uint8_t)str[0], &str[1]);
+				else
+					printf("FILE %d %s\n", off, str);
+				break;
+			case TAG_ATTR:
+				printf("ATTR %d %s\n", off, str);
+				break;
+			case TAG_SET:
+				len = ((size_t)(uint8_t)str[0]) | (((size_t)(uint8_t)str[1]) << 8);
+				printf("SET  %d %d %.*s\n", off, (int)len, (int)len, &str[2]);
+				break;
+			}
+		}
+	}
+	printf("TRUNCATED\n");
 }
 
 void main(int ac, char **av)
 {
+	struct capture cap;
+	const char *snapshot = NULL;
+	uint32_t idx;
+	int i0 = 1;
+
+	/* get options */
+	while (i0 < ac && av[i0][0] == '-' && av[i0][1] != 0) {
+		if (strcmp(av[i0], "-D") == 0 && i0 + 1 < ac)
+			capture_dictionary(av[++i0]);
+		else if (strcmp(av[i0], "-n") == 0 && i0 + 1 < ac)
+			snapshot = av[++i0];
+		else if (strcmp(av[i0], "-s") == 0)
+			output = OUT_STATS;
+		else if (strcmp(av[i0], "-t") == 0)
+			output = OUT_TSV;
+		else if (strcmp(av[i0], "-j") == 0)
+			output = OUT_JSON;
+		else
+			break;
+		i0++;
+	}
 
 	/* check argument count */
-	if (ac != 3) {
-		fprintf(stderr, "usage: %s FILE ROOT\n", av[0]);
+	if (ac != i0 + 2) {
+		fprintf(stderr, "usage: %s [-D dict] [-n name] [-s|-t|-j] FILE ROOT\n", av[0]);
 		exit(EXIT_FAILURE);
 	}
 
-	/* map the file */
-	base = mapin(av[1]);
+	/* open the file */
+	capture_open(&cap, av[i0]);
+	if (snapshot != NULL)
+		capture_select(&cap, snapshot);
 
 	/* process the root */
-	process(base, 0, 0, av[2]);
+	front = (cap.flags & FLAG_FRONT) != 0;
+	if (output != OUT_DUMP) {
+		if (output == OUT_JSON)
+			out("[\n", 2);
+		analyze(&cap, av[i0 + 1]);
+		if (output == OUT_JSON)
+			out("\n]\n", 3);
+		flush();
+		if (output == OUT_STATS)
+			print_stats();
+	}
+	else if (cap.flags & FLAG_STREAM)
+		stream(&cap, av[i0 + 1]);
+	else {
+		base = (uint32_t*)cap.body;
+		for (idx = 0 ; idx < cap.classes ; idx++) {
+			capture_class(&cap, idx);
+			if (cap.classes > 1)
+				printf("CLASS %u\n", (unsigned)idx);
+			process((uint32_t*)cap.body, 0, 0, av[i0 + 1]);
+		}
+	}
 
 	exit(EXIT_SUCCESS);
 }
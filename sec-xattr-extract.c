@@ -38,16 +38,24 @@
 #include <sys/types.h>
 #include <sys/xattr.h>
 #include <regex.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+
+#if WITH_ZSTD
+#include <zstd.h>
+#endif
+#if WITH_LZ4
+#include <lz4frame.h>
+#endif
 
 #include "sec-xattr-cp.h"
 
-/* record a string */
-struct recstr {
-	size_t size;        /* size of the string without zero */
-	struct recstr *nxt; /* next string record */
-	size_t offset;      /* final offset in file */
-	char value[];       /* the string terminated with a zero */
-};
+/* size of data given at once to the lz4 compressor */
+#define ZCHUNK (1 << 16)
 
 /* record the setting of an attribute */
 struct recattr {
@@ -62,10 +70,34 @@ struct recentry {
 	struct recentry *nxt;  /* next entry */
 	struct recattr  *attr; /* list of attributes if any */
 	struct recentry *subs; /* list of entries for directories */
+	struct recstr   *fsub; /* front coded name for SUB */
+	struct recstr   *ffile;/* front coded name for FILE */
+	uint32_t subclasses;   /* priority classes of the entries of subs */
+	uint8_t class;         /* priority class of the attributes */
+	uint32_t fileoff;      /* offset of the FILE code of the attributes */
+	struct recstr *fileattr;/* attribute set before the FILE code */
+};
+
+/* a mount point crossed, scanned by the worker of its device */
+struct mount {
+	const char *path;       /* path relative to the root */
+	char *full;             /* path of the mount point */
+	struct worker *worker;  /* worker of the device */
+	struct recentry *tree;  /* entries scanned by the worker */
+	struct mount *nxt;      /* next mount point */
 };
 
-/* root of strings */
-struct recstr *recstrs = NULL;
+/* a thread scanning the mount points of a device */
+struct worker {
+	unsigned long dev;      /* the device */
+	pthread_t thread;       /* the thread */
+	struct recstr *strs;    /* strings of the worker */
+	struct recstr **strtab; /* hash table of the strings of the worker */
+	struct worker *nxt;     /* next worker */
+};
+
+/* the strings and the scanning state are per thread, the strings
+ * scanned by workers being merged by the main thread */
 
 /* root of entries */
 struct recentry *root = NULL;
@@ -74,13 +106,13 @@ struct recentry *root = NULL;
 struct recstr *curattr;
 
 /* array for listing attribute names */
-char lstattr[65536];
+__thread char lstattr[65536];
 
 /* array for getting attribute values and their prefixed length */
-char valattr[2 + 65535];
+__thread char valattr[2 + 65535];
 
 /* current path */
-char path[PATH_MAX];
+__thread char path[PATH_MAX];
 
 /* should dump? */
 bool dump = false;
@@ -90,21 +122,72 @@ bool pattern = false;
 regex_t rex;
 
 /* root device */
-unsigned long rootdev;
+__thread unsigned long rootdev;
 
-/* allocation of memory */
-void *alloc(size_t sz)
-{
-	void *result = malloc(sz);
-	if (result == NULL) {
-		fprintf(stderr, "out of memory\n");
-		exit(EXIT_FAILURE);
-	}
-	return result;
-}
+/* mount points to cross and their workers */
+struct mount *mounts = NULL;
+struct worker *workers = NULL;
+
+/* watching the root, files vanishing while read are then ignored */
+bool watching = false;
+
+/* should read a tar archive */
+bool tarball = false;
+
+/* the tar archive */
+int tarfd;
+const char *tarpath;
+char tarbuf[1 << 20];
+size_t tarpos = 0;
+size_t tarlen = 0;
+
+/* should write the stream variant */
+bool streamed = false;
+
+/* should front code the names */
+bool front = false;
+
+/* priority classes, the last one for paths matching no pattern */
+unsigned nclasses = 1;
+regex_t classrex[CLASS_MAX - 1];
+size_t classoffs[CLASS_MAX];
+unsigned curclass = 0;
+
+/* path of entries relative to the root, for classes and index */
+char clspath[PATH_MAX];
+
+/* should write the index of paths */
+bool indexed = false;
+
+/* the buckets of the index, its offset and the padding before */
+char *idxtab = NULL;
+uint32_t idxbuckets;
+size_t idxoff;
+size_t idxpad;
+
+/* block being built for the stream variant */
+unsigned blkid = 1;
+size_t blkstrsz = 0;
+size_t blkcodecnt = 0;
+char blkstrs[BLOCK_MAX];
+uint32_t blkcodes[BLOCK_MAX / sizeof(uint32_t)];
+
+/* compression of the file */
+uint32_t zmethod = 0;
+int zlevel;
+const char *zdict = NULL;
+char *zbuf = NULL;
+size_t zbufsz;
+#if WITH_ZSTD
+ZSTD_CCtx *zcctx;
+#endif
+#if WITH_LZ4
+LZ4F_cctx *lcctx;
+LZ4F_preferences_t lprefs;
+#endif
 
 /* write the file */
-void wr(int fd, const void *ptr, size_t sz)
+void wrfile(int fd, const void *ptr, size_t sz)
 {
 	ssize_t rc = write(fd, ptr, sz);
 	if (rc < 0) {
@@ -112,8 +195,161 @@ void wr(int fd, const void *ptr, size_t sz)
 			fprintf(stderr, "write error\n");
 			exit(EXIT_FAILURE);
 		}
-		wr(fd, ptr, sz);
+		wrfile(fd, ptr, sz);
+	}
+	else if ((size_t)rc < sz)
+		wrfile(fd, &((const char*)ptr)[rc], sz - (size_t)rc);
+}
+
+/* write the compressed file, ending the compression if end is true */
+void zwr(int fd, const void *ptr, size_t sz, bool end)
+{
+	switch (zmethod) {
+#if WITH_ZSTD
+	case ZMETHOD_ZSTD: {
+		ZSTD_inBuffer in = { ptr, sz, 0 };
+		size_t rc;
+		do {
+			ZSTD_outBuffer out = { zbuf, zbufsz, 0 };
+			rc = ZSTD_compressStream2(zcctx, &out, &in, end ? ZSTD_e_end : ZSTD_e_continue);
+			if (ZSTD_isError(rc)) {
+				fprintf(stderr, "compression error: %s\n", ZSTD_getErrorName(rc));
+				exit(EXIT_FAILURE);
+			}
+			if (out.pos > 0)
+				wrfile(fd, zbuf, out.pos);
+		} while (end ? rc != 0 : in.pos < in.size);
+		break;
+	}
+#endif
+#if WITH_LZ4
+	case ZMETHOD_LZ4: {
+		size_t rc, len;
+		while (sz > 0 || end) {
+			len = sz < ZCHUNK ? sz : ZCHUNK;
+			if (len > 0)
+				rc = LZ4F_compressUpdate(lcctx, zbuf, zbufsz, ptr, len, NULL);
+			else {
+				rc = LZ4F_compressEnd(lcctx, zbuf, zbufsz, NULL);
+				end = false;
+			}
+			if (LZ4F_isError(rc)) {
+				fprintf(stderr, "compression error: %s\n", LZ4F_getErrorName(rc));
+				exit(EXIT_FAILURE);
+			}
+			if (rc > 0)
+				wrfile(fd, zbuf, rc);
+			ptr = &((const char*)ptr)[len];
+			sz -= len;
+		}
+		break;
+	}
+#endif
+	}
+}
+
+/* write the file, compressing it if required */
+void wr(int fd, const void *ptr, size_t sz)
+{
+	if (zmethod != 0)
+		zwr(fd, ptr, sz, false);
+	else
+		wrfile(fd, ptr, sz);
+}
+
+/* write the header of the container and start compressing
+ * the capture of the given size (0 if unknown) */
+void zstart(int fd, size_t size)
+{
+	char zhead[ZHEAD_SIZE];
+	void *dict = NULL;
+	size_t dictsz;
+	uint32_t method = htole32(zmethod);
+	uint64_t usize = htole64((uint64_t)size);
+
+	/* write the header */
+	memset(zhead, 0, sizeof zhead);
+	memcpy(zhead, SEC_XATTR_CP_ID_Z, SEC_XATTR_CP_ID_LEN);
+	memcpy(&zhead[SEC_XATTR_CP_ID_LEN], &method, sizeof method);
+	memcpy(&zhead[SEC_XATTR_CP_ID_LEN + 8], &usize, sizeof usize);
+	wrfile(fd, zhead, sizeof zhead);
+
+	/* the compressor is already set up when rewriting */
+	if (zbuf != NULL) {
+		switch (zmethod) {
+#if WITH_ZSTD
+		case ZMETHOD_ZSTD:
+			ZSTD_CCtx_setPledgedSrcSize(zcctx, size ? size : ZSTD_CONTENTSIZE_UNKNOWN);
+			break;
+#endif
+#if WITH_LZ4
+		case ZMETHOD_LZ4: {
+			size_t rc;
+			lprefs.frameInfo.contentSize = size;
+			rc = LZ4F_compressBegin(lcctx, zbuf, zbufsz, &lprefs);
+			if (LZ4F_isError(rc)) {
+				fprintf(stderr, "compression error: %s\n", LZ4F_getErrorName(rc));
+				exit(EXIT_FAILURE);
+			}
+			wrfile(fd, zbuf, rc);
+			break;
+		}
+#endif
+		}
+		return;
+	}
+
+	/* setup the compressor */
+	if (zdict != NULL)
+		dict = load_file(zdict, &dictsz);
+	switch (zmethod) {
+#if WITH_ZSTD
+	case ZMETHOD_ZSTD:
+		zcctx = ZSTD_createCCtx();
+		if (zcctx == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		ZSTD_CCtx_setParameter(zcctx, ZSTD_c_compressionLevel, zlevel);
+		ZSTD_CCtx_setParameter(zcctx, ZSTD_c_checksumFlag, 1);
+		if (size != 0)
+			ZSTD_CCtx_setPledgedSrcSize(zcctx, size);
+		if (dict != NULL && ZSTD_isError(ZSTD_CCtx_loadDictionary(zcctx, dict, dictsz))) {
+			fprintf(stderr, "invalid dictionary %s\n", zdict);
+			exit(EXIT_FAILURE);
+		}
+		zbufsz = ZSTD_CStreamOutSize();
+		zbuf = alloc(zbufsz);
+		break;
+#endif
+#if WITH_LZ4
+	case ZMETHOD_LZ4: {
+		size_t rc;
+		if (dict != NULL) {
+			fprintf(stderr, "no dictionary for lz4 compression\n");
+			exit(EXIT_FAILURE);
+		}
+		if (LZ4F_isError(LZ4F_createCompressionContext(&lcctx, LZ4F_VERSION))) {
+			fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		memset(&lprefs, 0, sizeof lprefs);
+		lprefs.frameInfo.contentSize = size;
+		lprefs.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+		lprefs.compressionLevel = zlevel;
+		zbufsz = LZ4F_compressBound(ZCHUNK, &lprefs);
+		zbuf = alloc(zbufsz);
+		rc = LZ4F_compressBegin(lcctx, zbuf, zbufsz, &lprefs);
+		if (LZ4F_isError(rc)) {
+			fprintf(stderr, "compression error: %s\n", LZ4F_getErrorName(rc));
+			exit(EXIT_FAILURE);
+		}
+		wrfile(fd, zbuf, rc);
+		break;
 	}
+#endif
+	}
+	free(dict);
 }
 
 /* extend the path */
@@ -126,43 +362,27 @@ void addpath(size_t pos, const char *str, size_t len)
 	memcpy(&path[pos], str, len);
 }
 
-/* return the string record for the given string */
-struct recstr *addstr(const char *value, size_t sz)
-{
-	/* search */
-	struct recstr **prv = &recstrs;
-	struct recstr *iter = recstrs;
-	while (iter != NULL && !(iter->size == sz && 0 == memcmp(value, iter->value, sz))) {
-		prv = &iter->nxt;
-		iter = iter->nxt;
-	}
-	if (iter == NULL) {
-		/* create if not found */
-		*prv = iter = alloc(sz + sizeof *iter);
-		iter->size = sz;
-		memcpy(iter->value, value, sz);
-		iter->nxt = NULL;
-		iter->offset = 0;
-	}
-	return iter;
-}
-
-/* compute the offsets of strings */
-void set_str_offsets(size_t initial)
+/* compute the offsets of strings and return the offset after them */
+size_t set_str_offsets(size_t initial)
 {
 	size_t offset = initial;
 	struct recstr *iter = recstrs;
 	while(iter != NULL) {
-		iter->offset = offset;
-		offset += iter->size;
+		if (iter->used) {
+			iter->offset = offset;
+			offset += iter->size;
+		}
 		iter = iter->nxt;
 	}
+	return offset;
 }
 
 /* write the strings */
 void write_str(int fd, size_t offset)
 {
 	struct recstr *iter = recstrs;
+	while (iter != NULL && !iter->used)
+		iter = iter->nxt;
 	if (iter != NULL) {
 		if (iter->offset != offset) {
 			fprintf(stderr, "internal error, string offset mismatch %lu and %lu\n",
@@ -170,7 +390,8 @@ void write_str(int fd, size_t offset)
 			exit(EXIT_FAILURE);
 		}
 		while(iter != NULL) {
-			wr(fd, iter->value, iter->size);
+			if (iter->used)
+				wr(fd, iter->value, iter->size);
 			iter = iter->nxt;
 		}
 	}
@@ -206,10 +427,87 @@ struct recentry *add_entry(struct recentry **phead, const char *str, size_t len)
 		iter->nxt = NULL;
 		iter->attr = NULL;
 		iter->subs = NULL;
+		iter->fsub = NULL;
+		iter->ffile = NULL;
+		iter->subclasses = 0;
+		iter->class = 0;
+		iter->fileoff = 0;
+		iter->fileattr = NULL;
 	}
 	return iter;
 }
 
+/* merge sort by name the list of entries */
+struct recentry *sort_list(struct recentry *list)
+{
+	struct recentry *slow, *fast, *other, *head = NULL, **tail = &head;
+
+	if (list == NULL || list->nxt == NULL)
+		return list;
+
+	/* split the list in sorted halves */
+	for (slow = list, fast = list->nxt ; fast != NULL && fast->nxt != NULL ; fast = fast->nxt->nxt)
+		slow = slow->nxt;
+	other = sort_list(slow->nxt);
+	slow->nxt = NULL;
+	list = sort_list(list);
+
+	/* merge them */
+	while (list != NULL && other != NULL) {
+		if (strcmp(other->name->value, list->name->value) < 0) {
+			*tail = other;
+			other = other->nxt;
+		}
+		else {
+			*tail = list;
+			list = list->nxt;
+		}
+		tail = &(*tail)->nxt;
+	}
+	*tail = list != NULL ? list : other;
+	return head;
+}
+
+/* sort by name the entries of each directory, so that
+ * front coding shares the prefixes of close names */
+struct recentry *sort_entries(struct recentry *list)
+{
+	struct recentry *entry;
+
+	list = sort_list(list);
+	for (entry = list ; entry != NULL ; entry = entry->nxt)
+		entry->subs = sort_entries(entry->subs);
+	return list;
+}
+
+/* free the list of attributes */
+void free_attrs(struct recattr *attr)
+{
+	struct recattr *nxt;
+	for ( ; attr != NULL ; attr = nxt) {
+		nxt = attr->nxt;
+		free(attr);
+	}
+}
+
+/* free the list of entries */
+void free_entries(struct recentry *entry)
+{
+	struct recentry *nxt;
+	for ( ; entry != NULL ; entry = nxt) {
+		nxt = entry->nxt;
+		free_entries(entry->subs);
+		free_attrs(entry->attr);
+		free(entry);
+	}
+}
+
+/* is the error due to a file removed while watching? */
+bool vanished()
+{
+	return watching && (errno == ENOENT || errno == ENOTDIR || errno == ENODATA);
+}
+
 /* scan the entry referenced by path, the basename starting at pos and being of len */
 void extr_entry(struct recentry **phead, size_t pos, size_t len)
 {
@@ -220,6 +518,8 @@ void extr_entry(struct recentry **phead, size_t pos, size_t len)
 	/* get the list of attributes */
 	rc = llistxattr(path, lstattr, sizeof lstattr);
 	if (rc < 0) {
+		if (vanished())
+			return;
 		fprintf(stderr, "Can't get attributes of file %s: %s\n", path, strerror(errno));
 		exit(EXIT_FAILURE);
 	}
@@ -249,6 +549,8 @@ void extr_entry(struct recentry **phead, size_t pos, size_t len)
 		/* get the value */
 		rc = lgetxattr(path, &lstattr[idx], &valattr[2], sizeof valattr - 2);
 		if (rc < 0) {
+			if (vanished())
+				continue;
 			fprintf(stderr, "Can't get attribute %s of file %s: %s\n",
 					       &lstattr[idx], path, strerror(errno));
 			exit(EXIT_FAILURE);
@@ -281,6 +583,8 @@ void extr_dir(struct recentry **phead, size_t pos, bool root)
 	/* open the directory */
 	dir = opendir(path);
 	if (dir == NULL) {
+		if (vanished())
+			return;
 		fprintf(stderr, "Failed to open directory %s: %s\n", path, strerror(errno));
 		exit(EXIT_FAILURE);
 	}
@@ -308,6 +612,8 @@ void extr_dir(struct recentry **phead, size_t pos, bool root)
 		/* enter sub directories */
 		if (ent->d_type == DT_DIR && strcmp(ent->d_name, ".") != 0) {
 			if (stat(path, &st) < 0) {
+				if (vanished())
+					continue;
 				fprintf(stderr, "Can't stat %s: %s\n", path, strerror(errno));
 				exit(EXIT_FAILURE);
 			}
@@ -325,6 +631,171 @@ void extr_dir(struct recentry **phead, size_t pos, bool root)
 	closedir(dir);
 }
 
+/* add the mount point of path relative to the root to cross */
+void add_mount(const char *rel)
+{
+	struct mount *m, **link;
+	const char *name = rel;
+	size_t len;
+	bool empty = true;
+
+	/* check the components */
+	while (*name != 0) {
+		len = strcspn(name, "/");
+		if ((len == 1 && name[0] == '.') || (len == 2 && name[0] == '.' && name[1] == '.')) {
+			fprintf(stderr, "invalid mount point %s\n", rel);
+			exit(EXIT_FAILURE);
+		}
+		empty = empty && len == 0;
+		name += len + (name[len] == '/');
+	}
+	if (empty) {
+		fprintf(stderr, "invalid mount point %s\n", rel);
+		exit(EXIT_FAILURE);
+	}
+
+	/* record it at end */
+	m = alloc(sizeof *m);
+	m->path = rel;
+	m->full = NULL;
+	m->worker = NULL;
+	m->tree = NULL;
+	m->nxt = NULL;
+	for (link = &mounts ; *link != NULL ; link = &(*link)->nxt);
+	*link = m;
+}
+
+/* scan the mount points of the worker */
+void *scan(void *arg)
+{
+	struct worker *wk = arg;
+	struct mount *m;
+	size_t len;
+
+	rootdev = wk->dev;
+	for (m = mounts ; m != NULL ; m = m->nxt) {
+		if (m->worker == wk) {
+			len = strlen(m->full);
+			addpath(0, m->full, len + 1);
+			extr_dir(&m->tree, len, true);
+		}
+	}
+	wk->strs = recstrs;
+	wk->strtab = strtab;
+	return NULL;
+}
+
+/* start a worker for each device of the mount points of the root rpth */
+void start_workers(const char *rpth)
+{
+	struct mount *m;
+	struct worker *wk;
+	struct stat st;
+	size_t len;
+	int rc;
+
+	for (m = mounts ; m != NULL ; m = m->nxt) {
+		/* check the directory */
+		len = strlen(rpth) + strlen(m->path) + 5;
+		m->full = alloc(len);
+		snprintf(m->full, len, "%s/%s", rpth, m->path);
+		if (stat(m->full, &st) < 0) {
+			fprintf(stderr, "Can't stat %s: %s\n", m->full, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		if (!S_ISDIR(st.st_mode)) {
+			fprintf(stderr, "%s is not a directory\n", m->full);
+			exit(EXIT_FAILURE);
+		}
+
+		/* get the worker of its device */
+		for (wk = workers ; wk != NULL && wk->dev != st.st_dev ; wk = wk->nxt);
+		if (wk == NULL) {
+			wk = alloc(sizeof *wk);
+			wk->dev = st.st_dev;
+			wk->strs = NULL;
+			wk->strtab = NULL;
+			wk->nxt = workers;
+			workers = wk;
+		}
+		m->worker = wk;
+	}
+
+	/* start the workers when all mount points are dispatched */
+	for (wk = workers ; wk != NULL ; wk = wk->nxt) {
+		rc = pthread_create(&wk->thread, NULL, scan, wk);
+		if (rc != 0) {
+			fprintf(stderr, "Can't create thread: %s\n", strerror(rc));
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+/* merge in the list of phead the entries of src scanned by a worker,
+ * the attributes of "." going to the entry self */
+void graft(struct recentry **phead, struct recentry *src, struct recentry *self)
+{
+	struct recentry *entry;
+	struct recattr *attr;
+
+	for ( ; src != NULL ; src = src->nxt) {
+		if (self != NULL && strcmp(src->name->value, ".") == 0)
+			entry = self;
+		else
+			entry = add_entry(phead, src->name->value, src->name->size);
+		/* a mount point is also scanned in its parent directory */
+		if (entry->attr == NULL)
+			for (attr = src->attr ; attr != NULL ; attr = attr->nxt)
+				add_attr(&entry->attr, attr->name->value, attr->name->size,
+						attr->value->value, attr->value->size);
+		if (src->subs != NULL)
+			graft(&entry->subs, src->subs, NULL);
+	}
+}
+
+/* wait the workers and merge the mount points in the tree */
+void join_workers()
+{
+	struct mount *m;
+	struct worker *wk;
+	struct recentry **phead, *entry;
+	struct recstr *str;
+	const char *name;
+	size_t len;
+
+	for (wk = workers ; wk != NULL ; wk = wk->nxt)
+		pthread_join(wk->thread, NULL);
+
+	/* merge in the order of the mount points */
+	for (m = mounts ; m != NULL ; m = m->nxt) {
+		if (m->tree == NULL)
+			continue;
+		phead = &root;
+		entry = NULL;
+		for (name = m->path ; *name != 0 ; name += len + (name[len] == '/')) {
+			len = strcspn(name, "/");
+			if (len != 0) {
+				addpath(0, name, len);
+				path[len] = 0;
+				entry = add_entry(phead, path, len + 1);
+				phead = &entry->subs;
+			}
+		}
+		graft(phead, m->tree, entry);
+		free_entries(m->tree);
+		m->tree = NULL;
+	}
+
+	/* release the strings of the workers */
+	for (wk = workers ; wk != NULL ; wk = wk->nxt) {
+		while ((str = wk->strs) != NULL) {
+			wk->strs = str->nxt;
+			free(str);
+		}
+		free(wk->strtab);
+	}
+}
+
 /* extract from root path rpath */
 void extract(const char *rpth)
 {
@@ -336,15 +807,315 @@ void extract(const char *rpth)
 		exit(EXIT_FAILURE);
 	}
 	rootdev = st.st_dev;
-	addpath(0, rpth, len);
+
+	/* the mount points are scanned concurrently */
+	if (mounts != NULL)
+		start_workers(rpth);
+	addpath(0, rpth, len + 1);
 	extr_dir(&root, len, true);
+	if (mounts != NULL)
+		join_workers();
+}
+
+/* read sz bytes of the archive in ptr, or skip them if ptr is NULL,
+ * returns false if its end is reached */
+bool tarread(void *ptr, size_t sz)
+{
+	ssize_t rc;
+	size_t len;
+
+	while (sz > 0) {
+		if (tarpos == tarlen) {
+			/* skip by seeking when possible */
+			if (ptr == NULL && sz > sizeof tarbuf
+			 && lseek(tarfd, (off_t)sz, SEEK_CUR) != (off_t)-1)
+				return true;
+			rc = read(tarfd, tarbuf, sizeof tarbuf);
+			if (rc < 0) {
+				if (errno == EINTR)
+					continue;
+				fprintf(stderr, "Can't read %s: %s\n", tarpath, strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+			if (rc == 0)
+				return false;
+			tarpos = 0;
+			tarlen = (size_t)rc;
+		}
+		len = tarlen - tarpos;
+		if (len > sz)
+			len = sz;
+		if (ptr != NULL) {
+			memcpy(ptr, &tarbuf[tarpos], len);
+			ptr = &((char*)ptr)[len];
+		}
+		tarpos += len;
+		sz -= len;
+	}
+	return true;
+}
+
+/* read the data of size sz following a header, if ptr is NULL it is skipped */
+void tardata(void *ptr, size_t sz)
+{
+	if (!tarread(ptr, sz) || !tarread(NULL, (512 - (sz & 511)) & 511)) {
+		fprintf(stderr, "truncated archive %s\n", tarpath);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* get the value of the numeric field of len bytes of a tar header */
+uint64_t tarnum(const char *field, size_t len)
+{
+	uint64_t val = 0;
+	size_t idx = 0;
+
+	if ((uint8_t)field[0] & 0x80) {
+		/* base 256 */
+		val = (uint8_t)field[0] & 0x7f;
+		while (++idx < len)
+			val = (val << 8) | (uint8_t)field[idx];
+	}
+	else {
+		/* octal */
+		while (idx < len && field[idx] == ' ')
+			idx++;
+		while (idx < len && field[idx] >= '0' && field[idx] <= '7')
+			val = (val << 3) | (uint64_t)(field[idx++] - '0');
+	}
+	return val;
+}
+
+/* record the attributes listed in the pax header data of size sz, for the entry name */
+void tarentry(const char *name, char *data, size_t sz)
+{
+	static const char prefix[] = "SCHILY.xattr.";
+	struct recentry *entry, **phead;
+	const char *orig = name;
+	size_t pos, reclen, len, szval;
+	char *rec, *key, *val, *end, *comp;
+
+	/* normalize the path: relative without empty and . components,
+	 * .. components are refused as they could escape the root */
+	for (pos = 0 ; *name ; name += len + (name[len] == '/')) {
+		len = strcspn(name, "/");
+		if (len == 0 || (len == 1 && name[0] == '.'))
+			continue;
+		if (len == 2 && name[0] == '.' && name[1] == '.') {
+			fprintf(stderr, "unsafe path %s in %s\n", orig, tarpath);
+			exit(EXIT_FAILURE);
+		}
+		if (pos > 0)
+			addpath(pos++, "/", 1);
+		addpath(pos, name, len);
+		pos += len;
+	}
+	if (pos == 0)
+		addpath(pos++, ".", 1);
+	addpath(pos, "", 1);
+
+	/* scan the records */
+	entry = NULL;
+	for (pos = 0 ; pos < sz ; pos += reclen) {
+		/* extract the record "LEN KEY=VALUE\n" */
+		rec = &data[pos];
+		reclen = (size_t)strtoul(rec, &key, 10);
+		if (reclen == 0 || *key != ' ' || reclen > sz - pos || rec[reclen - 1] != '\n') {
+			fprintf(stderr, "invalid pax header for %s in %s\n", path, tarpath);
+			exit(EXIT_FAILURE);
+		}
+		key++;
+		end = &rec[reclen - 1];
+		val = memchr(key, '=', (size_t)(end - key));
+		if (val == NULL || strncmp(key, prefix, sizeof prefix - 1) != 0)
+			continue;
+		*val++ = 0;
+		key += sizeof prefix - 1;
+		szval = (size_t)(end - val);
+		if (pattern && regexec(&rex, key, 0, NULL, 0))
+			continue;
+		if (szval > UINT16_MAX) {
+			fprintf(stderr, "too big attribute %s in file %s\n", key, path);
+			exit(EXIT_FAILURE);
+		}
+
+		/* get/create the entry on need, replacing previous attributes */
+		if (entry == NULL) {
+			phead = &root;
+			for (comp = path ; (end = strchr(comp, '/')) != NULL ; comp = end + 1) {
+				*end = 0;
+				entry = add_entry(phead, comp, (size_t)(end - comp) + 1);
+				*end = '/';
+				phead = &entry->subs;
+			}
+			entry = add_entry(phead, comp, strlen(comp) + 1);
+			entry->attr = NULL;
+		}
+
+		/* record the attribute in the entry */
+		if (dump)
+			printf("%s\t%s\t%.*s\n", path, key, (int)szval, val);
+		valattr[0] = (char)(uint8_t)(szval & 255);
+		valattr[1] = (char)(uint8_t)((szval >> 8) & 255);
+		memcpy(&valattr[2], val, szval);
+		add_attr(&entry->attr, key, strlen(key) + 1, valattr, szval + 2);
+	}
+}
+
+/* get in name the path recorded in the pax header data of size sz, if any */
+void tarpaxpath(const char *data, size_t sz, char **name)
+{
+	size_t pos, reclen, len;
+	char *key;
+
+	for (pos = 0 ; pos < sz ; pos += reclen) {
+		reclen = (size_t)strtoul(&data[pos], &key, 10);
+		if (reclen == 0 || reclen > sz - pos)
+			return;
+		if (reclen > 7 && strncmp(key, " path=", 6) == 0) {
+			free(*name);
+			*name = alloc(reclen);
+			len = (size_t)(&data[pos + reclen - 1] - &key[6]);
+			memcpy(*name, &key[6], len);
+			(*name)[len] = 0;
+		}
+	}
+}
+
+/* extract from the tar archive of path tpth ("-" for stdin) */
+void extract_tar(const char *tpth)
+{
+	char head[512], name[sizeof path];
+	char *pax = NULL, *longname = NULL;
+	size_t paxsz = 0, idx, sz;
+	unsigned sum;
+
+	/* open the archive */
+	tarpath = tpth;
+	tarfd = strcmp(tpth, "-") == 0 ? 0 : open(tpth, O_RDONLY);
+	if (tarfd < 0) {
+		fprintf(stderr, "Can't open %s: %s\n", tpth, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	/* loop on headers */
+	while (tarread(head, sizeof head)) {
+		/* check the header, stop at the ending zero block */
+		for (sum = 0, idx = 0 ; idx < sizeof head ; idx++)
+			sum += idx >= 148 && idx < 156 ? ' ' : (uint8_t)head[idx];
+		if (sum == 8 * ' ')
+			break;
+		if (sum != tarnum(&head[148], 8)) {
+			fprintf(stderr, "invalid header in archive %s\n", tpth);
+			exit(EXIT_FAILURE);
+		}
+		sz = (size_t)tarnum(&head[124], 12);
+
+		switch (head[156]) {
+		case 'x':
+		case 'L':
+			/* pax header or GNU long name for the next entry */
+			if (head[156] == 'x') {
+				free(pax);
+				pax = alloc(sz + 1);
+				paxsz = sz;
+				tardata(pax, sz);
+				pax[sz] = 0;
+			}
+			else {
+				free(longname);
+				longname = alloc(sz + 1);
+				tardata(longname, sz);
+				longname[sz] = 0;
+			}
+			break;
+		case 'g':
+		case 'K':
+			/* global headers and GNU long link names are skipped */
+			tardata(NULL, sz);
+			break;
+		default:
+			/* entry, its name is from pax, GNU long name or ustar */
+			if (pax != NULL)
+				tarpaxpath(pax, paxsz, &longname);
+			if (longname != NULL)
+				snprintf(name, sizeof name, "%s", longname);
+			else if (memcmp(&head[257], "ustar", 5) == 0 && head[345] != 0)
+				snprintf(name, sizeof name, "%.155s/%.100s", &head[345], head);
+			else
+				snprintf(name, sizeof name, "%.100s", head);
+			if (pax != NULL)
+				tarentry(name, pax, paxsz);
+			free(pax);
+			free(longname);
+			pax = longname = NULL;
+			/* contents are skipped, links and special files have none */
+			tardata(NULL, head[156] >= '1' && head[156] <= '6' ? 0 : sz);
+			break;
+		}
+	}
+	if (tarfd != 0)
+		close(tarfd);
+}
+
+/* write the block of the stream variant and start a new one */
+void flush_block(int fd)
+{
+	uint32_t head[2];
+
+	/* the strings end with a zero, even after a value */
+	do
+		blkstrs[blkstrsz++] = 0;
+	while (blkstrsz & 3);
+	head[0] = htole32((uint32_t)blkstrsz);
+	head[1] = htole32((uint32_t)(blkcodecnt * sizeof(uint32_t)));
+	wr(fd, head, sizeof head);
+	wr(fd, blkstrs, blkstrsz);
+	wr(fd, blkcodes, blkcodecnt * sizeof(uint32_t));
+	blkid++;
+	blkstrsz = 0;
+	blkcodecnt = 0;
+}
+
+/* put the operation in the current block, its string before it */
+void putblockop(int fd, uint32_t op, struct recstr *str)
+{
+	size_t strsz = blkstrsz;
+
+	/* flush the block if full */
+	if (str != NULL && str->block != blkid)
+		strsz += str->size;
+	if (BLOCK_HEAD + ((strsz + 4) & ~(size_t)3) + (blkcodecnt + 1) * sizeof(uint32_t) > BLOCK_MAX) {
+		flush_block(fd);
+		if (str != NULL)
+			strsz = str->size;
+	}
+
+	/* argument of op, recorded once per block */
+	if (str != NULL) {
+		if (str->block != blkid) {
+			memcpy(&blkstrs[blkstrsz], str->value, str->size);
+			str->offset = BLOCK_HEAD + blkstrsz;
+			str->block = blkid;
+			blkstrsz = strsz;
+		}
+		op |= ((uint32_t)str->offset) << TAG_WIDTH;
+	}
+	blkcodes[blkcodecnt++] = htole32(op);
 }
 
 /* put the operation being at offset and return the offset of the next operation */
 size_t putop(int fd, size_t offset, uint32_t op, struct recstr *str)
 {
+	if (streamed) {
+		if (fd >= 0)
+			putblockop(fd, op, str);
+		return offset;
+	}
 	/* offset of next */
 	offset += sizeof(uint32_t);
+	if (fd < 0 && str != NULL)
+		str->used = true;
 	if (fd >= 0) {
 		/* argument of op */
 		if (str != NULL)
@@ -356,21 +1127,141 @@ size_t putop(int fd, size_t offset, uint32_t op, struct recstr *str)
 	return offset;
 }
 
+/* return the priority class of the path */
+unsigned class_of(const char *path)
+{
+	unsigned idx;
+
+	for (idx = 0 ; idx < nclasses - 1 ; idx++)
+		if (regexec(&classrex[idx], path, 0, NULL, 0) == 0)
+			break;
+	return idx;
+}
+
+/* put in clspath at offset the path of the entry, the root being "/",
+ * returns the offset after it */
+size_t entry_path(struct recentry *entry, size_t offset)
+{
+	size_t len = offset == 0 && strcmp(entry->name->value, ".") == 0 ? 0 : entry->name->size - 1;
+
+	if (offset + len + 2 > sizeof clspath) {
+		fprintf(stderr, "file too long %.*s/%s\n", (int)offset, clspath, entry->name->value);
+		exit(EXIT_FAILURE);
+	}
+	clspath[offset] = '/';
+	memcpy(&clspath[offset + 1], entry->name->value, len);
+	clspath[offset + 1 + len] = 0;
+	return offset + 1 + len;
+}
+
+/* set the classes of the entries of the list whose directory is in clspath
+ * at offset, returns the classes of the list */
+uint32_t set_classes(struct recentry *entry, size_t offset)
+{
+	uint32_t classes = 0;
+	size_t len;
+
+	for ( ; entry != NULL ; entry = entry->nxt) {
+		len = entry_path(entry, offset);
+		if (entry->attr != NULL) {
+			entry->class = (uint8_t)class_of(clspath);
+			classes |= (uint32_t)1 << entry->class;
+		}
+		entry->subclasses = set_classes(entry->subs, len);
+		classes |= entry->subclasses;
+	}
+	return classes;
+}
+
+/* count the entries having attributes */
+size_t count_files(struct recentry *entry)
+{
+	size_t count = 0;
+
+	for ( ; entry != NULL ; entry = entry->nxt)
+		count += (entry->attr != NULL) + count_files(entry->subs);
+	return count;
+}
+
+/* add to the index the entries of the list whose directory is in clspath at offset */
+void index_entries(struct recentry *entry, size_t offset)
+{
+	uint64_t hash;
+	uint32_t slot, value;
+	size_t len;
+	char *ent;
+
+	for ( ; entry != NULL ; entry = entry->nxt) {
+		len = entry_path(entry, offset);
+		if (entry->attr != NULL) {
+			/* linear probing from the slot of the hash */
+			hash = capture_hash(clspath, len, 0);
+			slot = (uint32_t)hash & (idxbuckets - 1);
+			while (*(uint32_t*)&idxtab[slot * INDEX_ENTRY + 8] != 0)
+				slot = (slot + 1) & (idxbuckets - 1);
+			ent = &idxtab[slot * INDEX_ENTRY];
+			hash = htole64(hash);
+			memcpy(ent, &hash, sizeof hash);
+			value = htole32(entry->fileoff);
+			memcpy(&ent[8], &value, sizeof value);
+			value = htole32(entry->fileattr == NULL ? 0 : (uint32_t)entry->fileattr->offset);
+			memcpy(&ent[12], &value, sizeof value);
+		}
+		index_entries(entry->subs, len);
+	}
+}
+
+/* build the index placed at offset, returns the offset after it */
+size_t build_index(size_t offset)
+{
+	size_t count = count_files(root);
+
+	/* at most 3 buckets of 4 are used */
+	idxbuckets = 16;
+	while ((size_t)idxbuckets * 3 < count * 4)
+		idxbuckets <<= 1;
+	free(idxtab);
+	idxtab = alloc((size_t)idxbuckets * INDEX_ENTRY);
+	memset(idxtab, 0, (size_t)idxbuckets * INDEX_ENTRY);
+	idxpad = (8 - (offset & 7)) & 7;
+	idxoff = offset + idxpad;
+	index_entries(root, 0);
+	return idxoff + (size_t)idxbuckets * INDEX_ENTRY;
+}
+
 /* write operations for entry starting at offset and return the offset after */
 size_t write_ops(struct recentry *entry, size_t offset, int fd)
 {
 	struct recattr *attr;
+	struct recstr *prev = NULL;
+	bool hassubs, hasattr;
 	/* write the entry's ops */
 	while (entry != NULL) {
+		/* parts of the entry in the current class */
+		hassubs = entry->subs != NULL && (nclasses == 1 || (entry->subclasses >> curclass) & 1);
+		hasattr = entry->attr != NULL && (nclasses == 1 || entry->class == curclass);
+		/* front code the names, relative to the previous one */
+		if (front && (fd < 0 || streamed || nclasses > 1)) {
+			if (hassubs)
+				entry->fsub = frontstr(prev, entry->name);
+			if (hasattr)
+				entry->ffile = frontstr(hassubs ? entry->name : prev, entry->name);
+		}
+		if (hassubs || hasattr)
+			prev = entry->name;
 		/* enter subdirectory if needed */
-		if (entry->subs) {
-			offset = putop(fd, offset, TAG_SUB, entry->name);
+		if (hassubs) {
+			offset = putop(fd, offset, TAG_SUB, front ? entry->fsub : entry->name);
 			offset = write_ops(entry->subs, offset, fd);
 		}
 		/* write attributes if any */
-		attr = entry->attr;
+		attr = hasattr ? entry->attr : NULL;
 		if (attr != NULL) {
-			offset = putop(fd, offset, TAG_FILE, entry->name);
+			if (fd < 0) {
+				entry->fileoff = (uint32_t)offset;
+				entry->fileattr = curattr;
+			}
+			offset = putop(fd, offset, TAG_FILE, front ? entry->ffile : entry->name);
 			while (attr != NULL) {
 				if (attr->name != curattr) {
 					offset = putop(fd, offset, TAG_ATTR, attr->name);
@@ -386,37 +1277,670 @@ size_t write_ops(struct recentry *entry, size_t offset, int fd)
 	return putop(fd, offset, TAG_SUB, NULL);
 }
 
-void prepare()
+/* flags of the format */
+uint32_t head_flags()
+{
+	return (streamed ? FLAG_STREAM : 0) | (front ? FLAG_FRONT : 0)
+	     | (nclasses > 1 ? FLAG_CLASSES : 0) | (indexed ? FLAG_INDEX : 0);
+}
+
+/* size of the header */
+size_t head_size()
+{
+	return SEC_XATTR_CP_ID_LEN + (head_flags() ? sizeof(uint32_t) : 0)
+	     + (nclasses > 1 ? (nclasses + 1) * sizeof(uint32_t) : 0)
+	     + (indexed ? 2 * sizeof(uint32_t) : 0);
+}
+
+/* write the header, the version 1 if no flag is needed, returns its size */
+size_t write_head(int fd)
+{
+	uint32_t flags = head_flags(), value;
+	unsigned idx;
+
+	if (flags == 0)
+		wr(fd, SEC_XATTR_CP_ID_V1, SEC_XATTR_CP_ID_LEN);
+	else {
+		wr(fd, SEC_XATTR_CP_ID_V2, SEC_XATTR_CP_ID_LEN);
+		flags = htole32(flags);
+		wr(fd, &flags, sizeof flags);
+	}
+	if (nclasses > 1) {
+		value = htole32((uint32_t)nclasses);
+		wr(fd, &value, sizeof value);
+		for (idx = 0 ; idx < nclasses ; idx++) {
+			value = htole32((uint32_t)classoffs[idx]);
+			wr(fd, &value, sizeof value);
+		}
+	}
+	if (indexed) {
+		value = htole32((uint32_t)idxoff);
+		wr(fd, &value, sizeof value);
+		value = htole32(idxbuckets);
+		wr(fd, &value, sizeof value);
+	}
+	return head_size();
+}
+
+/* compute the offsets and return the size of the file */
+size_t prepare()
 {
 	size_t offset;
 
-	offset = strlen(SEC_XATTR_CP_ID_V1);
+	offset = head_size();
+	if (nclasses > 1)
+		set_classes(root, 0);
+	for (curclass = 0 ; curclass < nclasses ; curclass++) {
+		/* the attribute is set again at start of each class */
+		classoffs[curclass] = offset;
+		curattr = NULL;
+		offset = write_ops(root, offset, -1);
+	}
+	offset = set_str_offsets(offset);
+	if (indexed)
+		offset = build_index(offset);
+	return offset;
+}
+
+void write_stream(int fd)
+{
+	/* write the header */
+	write_head(fd);
+	/* write the operations by blocks */
 	curattr = NULL;
-	offset = write_ops(root, offset, -1);
-	set_str_offsets(offset);
+	write_ops(root, 0, fd);
+	flush_block(fd);
 }
 
-void write_file(const char *path)
+void write_file(const char *path, size_t size)
 {
 	size_t offset;
+	int fd;
 	/* open / create the file */
-	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (strcmp(path, "-") == 0)
+		fd = 1;
+	else
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
 	if (fd < 0) {
 		fprintf(stderr, "Can't open file %s: %s\n", path, strerror(errno));
 		exit(EXIT_FAILURE);
 	}
-	/* write the header */
-	offset = strlen(SEC_XATTR_CP_ID_V1);
-	wr(fd, SEC_XATTR_CP_ID_V1, offset);
-	/* write the operations */
-	curattr = NULL;
-	offset = write_ops(root, offset, fd);
-	/* write the strings */
-	write_str(fd, offset);
+	if (zmethod != 0)
+		zstart(fd, size);
+	if (streamed)
+		write_stream(fd);
+	else {
+		/* write the header */
+		offset = write_head(fd);
+		/* write the operations */
+		for (curclass = 0 ; curclass < nclasses ; curclass++) {
+			curattr = NULL;
+			offset = write_ops(root, offset, fd);
+		}
+		/* write the strings */
+		write_str(fd, offset);
+		/* write the index */
+		if (indexed) {
+			wr(fd, "\0\0\0\0\0\0\0", idxpad);
+			wr(fd, idxtab, (size_t)idxbuckets * INDEX_ENTRY);
+		}
+	}
 	/* end */
+	if (zmethod != 0)
+		zwr(fd, NULL, 0, true);
+	if (watching)
+		fsync(fd);
 	close(fd);
 }
 
+/* mask of the events watched on directories */
+#define WATCH_MASK (IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO \
+		    | IN_DONT_FOLLOW | IN_ONLYDIR | IN_EXCL_UNLINK)
+
+/* record a watched directory */
+struct watch {
+	int wd;                /* the inotify watch descriptor */
+	struct watch *parent;  /* watch of the parent directory, NULL for root */
+	struct watch *subs;    /* watches of sub directories */
+	struct watch *nxt;     /* next watch of the same parent */
+	struct recstr *name;   /* name of the directory in its parent */
+};
+
+/* the inotify file descriptor */
+int infd;
+
+/* path of the root */
+const char *rootpath;
+
+/* did the last events change the entries? */
+bool changed;
+
+/* watches indexed by their descriptor */
+struct watch **watches = NULL;
+size_t watchsz = 0;
+
+/* return the link to the entry of name in the list phead
+ * or to the end of the list if not found */
+struct recentry **find_entry(struct recentry **phead, struct recstr *name)
+{
+	while (*phead != NULL && (*phead)->name != name)
+		phead = &(*phead)->nxt;
+	return phead;
+}
+
+/* set path to the directory of the watch and return its length */
+size_t watch_path(struct watch *w)
+{
+	size_t pos;
+
+	if (w->parent == NULL) {
+		pos = strlen(rootpath);
+		addpath(0, rootpath, pos + 1);
+		return pos;
+	}
+	pos = watch_path(w->parent);
+	if (pos == 0 || path[pos - 1] != '/')
+		addpath(pos++, "/", 1);
+	addpath(pos, w->name->value, w->name->size);
+	return pos + w->name->size - 1;
+}
+
+/* return the list of entries of the directory of the watch,
+ * creating it if create is true, or NULL if it doesn't exist */
+struct recentry **watch_head(struct watch *w, bool create)
+{
+	struct recentry **phead;
+
+	if (w->parent == NULL)
+		return &root;
+	phead = watch_head(w->parent, create);
+	if (phead == NULL)
+		return NULL;
+	if (create)
+		return &add_entry(phead, w->name->value, w->name->size)->subs;
+	phead = find_entry(phead, w->name);
+	return *phead == NULL ? NULL : &(*phead)->subs;
+}
+
+void prune(struct watch *w, struct recentry **link);
+
+/* remove the entry of the directory of w if it is empty */
+void prune_dir(struct watch *w)
+{
+	struct recentry **phead;
+
+	if (w->parent != NULL) {
+		phead = watch_head(w->parent, false);
+		if (phead != NULL)
+			prune(w->parent, find_entry(phead, w->name));
+	}
+}
+
+/* remove the entry of link in the directory of w if it is empty,
+ * and so on for the parent directories */
+void prune(struct watch *w, struct recentry **link)
+{
+	struct recentry *entry = *link;
+
+	if (entry != NULL && entry->attr == NULL && entry->subs == NULL) {
+		*link = entry->nxt;
+		free(entry);
+		prune_dir(w);
+	}
+}
+
+/* are the lists of attributes the same? */
+bool same_attrs(struct recattr *a, struct recattr *b)
+{
+	while (a != NULL && b != NULL && a->name == b->name && a->value == b->value) {
+		a = a->nxt;
+		b = b->nxt;
+	}
+	return a == b;
+}
+
+/* scan again the attributes of the entry of name in the directory of w */
+void watch_entry(struct watch *w, const char *name)
+{
+	struct recentry *scan = NULL, **phead, **link;
+	size_t pos, len = strlen(name);
+
+	/* read the attributes */
+	pos = watch_path(w);
+	if (pos == 0 || path[pos - 1] != '/')
+		addpath(pos++, "/", 1);
+	addpath(pos, name, len + 1);
+	extr_entry(&scan, pos, len);
+
+	/* replace the recorded ones */
+	phead = watch_head(w, scan != NULL);
+	if (phead == NULL)
+		return;
+	link = find_entry(phead, addstr(name, len + 1));
+	if (*link == NULL) {
+		*link = scan;
+		changed |= scan != NULL;
+	}
+	else if (!same_attrs((*link)->attr, scan == NULL ? NULL : scan->attr)) {
+		free_attrs((*link)->attr);
+		(*link)->attr = scan == NULL ? NULL : scan->attr;
+		free(scan);
+		prune(w, link);
+		changed = true;
+	}
+	else if (scan != NULL) {
+		free_attrs(scan->attr);
+		free(scan);
+	}
+}
+
+/* remove the entry of name in the directory of w */
+void watch_remove(struct watch *w, const char *name)
+{
+	struct recentry **phead = watch_head(w, false), **link, *entry;
+
+	if (phead != NULL) {
+		link = find_entry(phead, addstr(name, strlen(name) + 1));
+		entry = *link;
+		if (entry != NULL) {
+			*link = entry->nxt;
+			entry->nxt = NULL;
+			free_entries(entry);
+			prune_dir(w);
+			changed = true;
+		}
+	}
+}
+
+/* forget the watch w and its sub watches, removing them from inotify if rm */
+void unwatch(struct watch *w, bool rm)
+{
+	struct watch **link;
+
+	while (w->subs != NULL)
+		unwatch(w->subs, rm);
+	if (rm)
+		inotify_rm_watch(infd, w->wd);
+	for (link = &w->parent->subs ; *link != w ; link = &(*link)->nxt);
+	*link = w->nxt;
+	watches[w->wd] = NULL;
+	free(w);
+}
+
+/* watch the directory of name in parent (the root if parent is NULL)
+ * and its sub directories */
+void watch_dir(struct watch *parent, struct recstr *name)
+{
+	struct watch *w, dummy;
+	struct dirent *ent;
+	struct stat st;
+	size_t pos, len;
+	DIR *dir;
+	int wd;
+
+	/* watch the directory */
+	dummy.parent = parent;
+	dummy.name = name;
+	pos = watch_path(&dummy);
+	wd = inotify_add_watch(infd, path, WATCH_MASK);
+	if (wd < 0) {
+		if (vanished())
+			return;
+		fprintf(stderr, "Can't watch %s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if ((size_t)wd >= watchsz) {
+		len = watchsz ? watchsz << 1 : 1024;
+		while (len <= (size_t)wd)
+			len <<= 1;
+		watches = realloc(watches, len * sizeof *watches);
+		if (watches == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		memset(&watches[watchsz], 0, (len - watchsz) * sizeof *watches);
+		watchsz = len;
+	}
+	w = watches[wd];
+	if (w == NULL) {
+		w = watches[wd] = alloc(sizeof *w);
+		w->wd = wd;
+		w->parent = parent;
+		w->subs = NULL;
+		w->name = name;
+		if (parent != NULL) {
+			w->nxt = parent->subs;
+			parent->subs = w;
+		}
+	}
+
+	/* watch the sub directories */
+	dir = opendir(path);
+	if (dir == NULL) {
+		if (vanished())
+			return;
+		fprintf(stderr, "Failed to open directory %s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if (pos == 0 || path[pos - 1] != '/')
+		addpath(pos++, "/", 1);
+	while ((ent = readdir(dir)) != NULL) {
+		if (ent->d_type != DT_DIR || strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+			continue;
+		len = strlen(ent->d_name);
+		addpath(pos, ent->d_name, len + 1);
+		if (stat(path, &st) < 0) {
+			if (vanished())
+				continue;
+			fprintf(stderr, "Can't stat %s: %s\n", path, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		if (st.st_dev == rootdev)
+			watch_dir(w, addstr(ent->d_name, len + 1));
+	}
+	closedir(dir);
+}
+
+/* scan the new directory of name in w */
+void watch_new_dir(struct watch *w, const char *name)
+{
+	struct recentry *subs = NULL, **phead, **link;
+	struct recstr *str;
+	struct stat st;
+	size_t pos, len = strlen(name);
+
+	/* like the scan, directories of other devices are not entered */
+	watch_entry(w, name);
+	pos = watch_path(w);
+	if (pos == 0 || path[pos - 1] != '/')
+		addpath(pos++, "/", 1);
+	addpath(pos, name, len + 1);
+	if (stat(path, &st) < 0 || st.st_dev != rootdev)
+		return;
+
+	/* watch it before scanning it so that no change is missed */
+	str = addstr(name, len + 1);
+	watch_dir(w, str);
+
+	/* scan it */
+	pos = watch_path(w);
+	if (pos == 0 || path[pos - 1] != '/')
+		addpath(pos++, "/", 1);
+	addpath(pos, name, len + 1);
+	extr_dir(&subs, pos + len, false);
+
+	/* record it */
+	phead = watch_head(w, subs != NULL);
+	if (phead == NULL)
+		return;
+	link = find_entry(phead, str);
+	if (*link == NULL)
+		add_entry(phead, name, len + 1)->subs = subs;
+	else {
+		free_entries((*link)->subs);
+		(*link)->subs = subs;
+		prune(w, link);
+	}
+	changed = true;
+}
+
+/* process the inotify event */
+void watch_event(struct inotify_event *evt)
+{
+	struct watch *w, *sub;
+	struct recstr *name;
+
+	/* events were lost, scan again */
+	if (evt->mask & IN_Q_OVERFLOW) {
+		free_entries(root);
+		root = NULL;
+		watch_dir(NULL, NULL);
+		extract(rootpath);
+		changed = true;
+		return;
+	}
+
+	w = (evt->wd >= 0 && (size_t)evt->wd < watchsz) ? watches[evt->wd] : NULL;
+	if (w == NULL)
+		return;
+
+	/* events on the watched directory itself */
+	if (evt->len == 0) {
+		if (evt->mask & IN_IGNORED) {
+			if (w->parent == NULL) {
+				fprintf(stderr, "root %s removed\n", rootpath);
+				exit(EXIT_FAILURE);
+			}
+			unwatch(w, false);
+		}
+		else if (w->parent == NULL && (evt->mask & IN_ATTRIB))
+			watch_entry(w, ".");
+		return;
+	}
+
+	/* events on entries of the directory */
+	if (!(evt->mask & IN_ISDIR) || (evt->mask & IN_ATTRIB))
+		watch_entry(w, evt->name);
+	else if (evt->mask & (IN_CREATE | IN_MOVED_TO))
+		watch_new_dir(w, evt->name);
+	else {
+		/* removed or moved away, moved directories are watched again if moved in */
+		name = addstr(evt->name, strlen(evt->name) + 1);
+		for (sub = w->subs ; sub != NULL && sub->name != name ; sub = sub->nxt);
+		if (sub != NULL)
+			unwatch(sub, (evt->mask & IN_MOVED_FROM) != 0);
+		watch_remove(w, evt->name);
+	}
+}
+
+/* mark the strings used by the entries */
+void mark_entries(struct recentry *entry)
+{
+	struct recattr *attr;
+
+	for ( ; entry != NULL ; entry = entry->nxt) {
+		/* front coded names are computed again at write */
+		entry->fsub = NULL;
+		entry->ffile = NULL;
+		entry->name->used = true;
+		for (attr = entry->attr ; attr != NULL ; attr = attr->nxt) {
+			attr->name->used = true;
+			attr->value->used = true;
+		}
+		mark_entries(entry->subs);
+	}
+}
+
+/* remove the strings not used by entries or watches */
+void collect()
+{
+	struct recstr *iter, **link;
+	size_t idx;
+
+	/* mark */
+	for (iter = recstrs ; iter != NULL ; iter = iter->nxt)
+		iter->used = false;
+	mark_entries(root);
+	for (idx = 0 ; idx < watchsz ; idx++)
+		if (watches[idx] != NULL && watches[idx]->name != NULL)
+			watches[idx]->name->used = true;
+
+	/* sweep */
+	for (idx = 0 ; idx < strtabsz ; idx++) {
+		link = &strtab[idx];
+		while (*link != NULL)
+			if ((*link)->used)
+				link = &(*link)->hnxt;
+			else
+				*link = (*link)->hnxt;
+	}
+	link = &recstrs;
+	while ((iter = *link) != NULL) {
+		if (iter->used) {
+			iter->used = false;
+			link = &iter->nxt;
+		}
+		else {
+			*link = iter->nxt;
+			free(iter);
+			strcount--;
+		}
+	}
+	strtail = link;
+}
+
+/* write the capture in file atomically */
+void rewrite(const char *file)
+{
+	char tmp[PATH_MAX];
+	size_t size = 0;
+
+	if (snprintf(tmp, sizeof tmp, "%s.new", file) >= (int)sizeof tmp) {
+		fprintf(stderr, "file too long %s\n", file);
+		exit(EXIT_FAILURE);
+	root = sort_entries(root);
+	}
+	collect();
+	if (!streamed)
+		size = prepare();
+	write_file(tmp, size);
+	if (rename(tmp, file) < 0) {
+		fprintf(stderr, "Can't rename %s to %s: %s\n", tmp, file, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* keep the capture in file up to date with changes of the root rpth,
+ * writing it after delay seconds without change, on SIGUSR1 and at end */
+void watch(const char *file, const char *rpth, int delay)
+{
+	char buffer[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct signalfd_siginfo si;
+	struct inotify_event *evt;
+	struct pollfd pfd[2];
+	struct timespec now, last;
+	struct stat st;
+	sigset_t sigs;
+	bool dirty = false;
+	ssize_t rc;
+	size_t pos;
+	long timeout;
+
+	/* get the signals */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGUSR1);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	sigprocmask(SIG_BLOCK, &sigs, NULL);
+	pfd[1].fd = signalfd(-1, &sigs, SFD_CLOEXEC);
+	infd = pfd[0].fd = inotify_init1(IN_CLOEXEC);
+	if (pfd[0].fd < 0 || pfd[1].fd < 0) {
+		fprintf(stderr, "Can't watch: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	pfd[0].events = pfd[1].events = POLLIN;
+
+	/* watch before the initial scan so that no change is missed */
+	if (stat(rpth, &st) < 0) {
+		fprintf(stderr, "Can't stat %s: %s\n", rpth, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	rootdev = st.st_dev;
+	rootpath = rpth;
+	watch_dir(NULL, NULL);
+	extract(rpth);
+	rewrite(file);
+
+	for (;;) {
+		/* wait for events or the end of the delay */
+		timeout = -1;
+		if (dirty && delay > 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			timeout = delay * 1000L - (now.tv_sec - last.tv_sec) * 1000L
+			        - (now.tv_nsec - last.tv_nsec) / 1000000L;
+			if (timeout < 0)
+				timeout = 0;
+		}
+		rc = poll(pfd, 2, (int)timeout);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "poll error: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		if (rc == 0) {
+			rewrite(file);
+			dirty = false;
+			continue;
+		}
+
+		/* process the events */
+		if (pfd[0].revents & POLLIN) {
+			rc = read(infd, buffer, sizeof buffer);
+			if (rc < 0 && errno != EINTR) {
+				fprintf(stderr, "inotify error: %s\n", strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+			changed = false;
+			for (pos = 0 ; rc > 0 && pos < (size_t)rc ; pos += sizeof *evt + evt->len) {
+				evt = (struct inotify_event*)&buffer[pos];
+				watch_event(evt);
+			}
+			if (changed) {
+				dirty = true;
+				clock_gettime(CLOCK_MONOTONIC, &last);
+			}
+		}
+
+		/* process the signals */
+		if ((pfd[1].revents & POLLIN) && read(pfd[1].fd, &si, sizeof si) == sizeof si) {
+			if (dirty || si.ssi_signo == SIGUSR1) {
+				rewrite(file);
+				dirty = false;
+			}
+			if (si.ssi_signo != SIGUSR1)
+				exit(EXIT_SUCCESS);
+		}
+	}
+}
+
+/* get the delay in seconds of str */
+int get_delay(const char *str)
+{
+	char *end;
+	long delay = strtol(str, &end, 10);
+
+	if (*str == 0 || *end != 0 || delay < 0 || delay > INT_MAX / 1000) {
+		fprintf(stderr, "invalid delay %s\n", str);
+		exit(EXIT_FAILURE);
+	}
+	return (int)delay;
+}
+
+void set_compression(const char *spec)
+{
+	size_t len = strcspn(spec, ":");
+
+#if WITH_ZSTD
+	if (len == 4 && memcmp(spec, "zstd", 4) == 0) {
+		zmethod = ZMETHOD_ZSTD;
+		zlevel = 19;
+	}
+#endif
+#if WITH_LZ4
+	if (len == 3 && memcmp(spec, "lz4", 3) == 0) {
+		zmethod = ZMETHOD_LZ4;
+		zlevel = 9;
+	}
+#endif
+	if (zmethod == 0) {
+		fprintf(stderr, "unsupported compression %s\n", spec);
+		exit(EXIT_FAILURE);
+	}
+	if (spec[len] == ':')
+		zlevel = atoi(&spec[len + 1]);
+}
+
 void set_pattern(const char *pat)
 {
 	int rc = regcomp(&rex, pat, REG_EXTENDED|REG_NOSUB);
@@ -427,22 +1951,59 @@ void set_pattern(const char *pat)
 	pattern = true;
 }
 
+void add_class(const char *pat)
+{
+	int rc;
+
+	if (nclasses == CLASS_MAX) {
+		fprintf(stderr, "too many classes\n");
+		exit(EXIT_FAILURE);
+	}
+	rc = regcomp(&classrex[nclasses - 1], pat, REG_EXTENDED|REG_NOSUB);
+	if (rc != 0) {
+		fprintf(stderr, "Can't compile pattern %s: %d\n", pat, rc);
+		exit(EXIT_FAILURE);
+	}
+	nclasses++;
+}
+
 void usage(char **av)
 {
-	printf("usage: %s [-d] [-m pattern] FILE ROOT\n");
+	printf("usage: %s [-d] [-s] [-f] [-t] [-w delay] [-m pattern] [-p pattern]... [-x mount]... [-i] [-z method[:level] [-D dict]] FILE ROOT\n", av[0]);
 	exit(EXIT_FAILURE);
 }
 
 void main(int ac, char **av)
 {
-	int idx = 1;
+	int idx = 1, delay = 0;
+	size_t size = 0;
 
 	/* get options */
-	while (idx < ac && av[idx][0] == '-') {
+	while (idx < ac && av[idx][0] == '-' && av[idx][1] != 0) {
 		if (strcmp(av[idx], "-d") == 0)
 			dump = true;
 		else if (strcmp(av[idx], "-m") == 0)
 			set_pattern(av[++idx]);
+		else if (strcmp(av[idx], "-p") == 0 && idx + 1 < ac)
+			add_class(av[++idx]);
+		else if (strcmp(av[idx], "-x") == 0 && idx + 1 < ac)
+			add_mount(av[++idx]);
+		else if (strcmp(av[idx], "-s") == 0)
+			streamed = true;
+		else if (strcmp(av[idx], "-f") == 0)
+			front = true;
+		else if (strcmp(av[idx], "-i") == 0)
+			indexed = true;
+		else if (strcmp(av[idx], "-t") == 0)
+			tarball = true;
+		else if (strcmp(av[idx], "-w") == 0 && idx + 1 < ac) {
+			watching = true;
+			delay = get_delay(av[++idx]);
+		}
+		else if (strcmp(av[idx], "-z") == 0 && idx + 1 < ac)
+			set_compression(av[++idx]);
+		else if (strcmp(av[idx], "-D") == 0 && idx + 1 < ac)
+			zdict = av[++idx];
 		else
 			usage(av);
 		idx++;
@@ -451,15 +2012,41 @@ void main(int ac, char **av)
 	/* check argument count */
 	if (idx + 2 != ac)
        		usage(av);
+	if (streamed && (nclasses > 1 || indexed)) {
+		fprintf(stderr, "can't use classes or index with the stream variant\n");
+		exit(EXIT_FAILURE);
+	}
+	if (mounts != NULL && (tarball || watching)) {
+		fprintf(stderr, "can't cross mount points with -t or -w\n");
+		exit(EXIT_FAILURE);
+	}
+	if (dump && strcmp(av[idx], "-") == 0) {
+		fprintf(stderr, "can't dump with the capture to the standard output\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* watch the root */
+	if (watching) {
+		if (tarball || strcmp(av[idx], "-") == 0) {
+			fprintf(stderr, "can't watch with -t or to the standard output\n");
+			exit(EXIT_FAILURE);
+		}
+		watch(av[idx], av[idx + 1], delay);
+	}
 
 	/* process the root */
-	extract(av[idx + 1]);
+	if (tarball)
+		extract_tar(av[idx + 1]);
+	else
+		extract(av[idx + 1]);
+	root = sort_entries(root);
 
 	/* prepare */
-	prepare();
+	if (!streamed)
+		size = prepare();
 
 	/* write */
-	write_file(av[idx]);
+	write_file(av[idx], size);
 
 	exit(EXIT_SUCCESS);
 }
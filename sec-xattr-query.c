@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2015-2025 IoT.bzh Company
+ * Author: José Bollo <jose.bollo@iot.bzh>
+ *
+ * $RP_BEGIN_LICENSE$
+ * Commercial License Usage
+ *  Licensees holding valid commercial IoT.bzh licenses may use this file in
+ *  accordance with the commercial license agreement provided with the
+ *  Software or, alternatively, in accordance with the terms contained in
+ *  a written agreement between you and The IoT.bzh Company. For licensing terms
+ *  and conditions see https://www.iot.bzh/terms-conditions. For further
+ *  information use the contact form at https://www.iot.bzh/contact.
+ *
+ * GNU General Public License Usage
+ *  Alternatively, this file may be used under the terms of the GNU General
+ *  Public license version 3. This license is as published by the Free Software
+ *  Foundation and appearing in the file LICENSE.GPLv3 included in the packaging
+ *  of this file. Please review the following information to ensure the GNU
+ *  General Public License requirements will be met
+ *  https://www.gnu.org/licenses/gpl-3.0.html.
+ * $RP_END_LICENSE$
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+
+#include "sec-xattr-cp.h"
+
+/* the path searched, relative to the root and starting with a slash */
+char canon[PATH_MAX];
+
+/* put in canon the path relative to the root, returns false if too long */
+bool canonical(const char *path)
+{
+	size_t pos = 0, len;
+
+	while (*path != 0) {
+		len = strcspn(path, "/");
+		if (len != 0 && !(len == 1 && path[0] == '.')) {
+			if (pos + len + 2 > sizeof canon)
+				return false;
+			canon[pos++] = '/';
+			memcpy(&canon[pos], path, len);
+			pos += len;
+		}
+		path += len + (path[len] == '/');
+	}
+	if (pos == 0)
+		canon[pos++] = '/';
+	canon[pos] = 0;
+	return true;
+}
+
+/* print the bytes */
+void out(const char *str, size_t len)
+{
+	fwrite(str, 1, len, stdout);
+}
+
+/* print the bytes escaped for TSV */
+void outesc(const char *str, size_t len)
+{
+	escape(str, len, false, out);
+}
+
+/* print the value of the attribute of the file of path given by closure */
+void print(void *closure, const char *attr, const char *value, size_t size)
+{
+	const char *path = closure;
+
+	outesc(path, strlen(path));
+	putchar('\t');
+	outesc(attr, strlen(attr));
+	putchar('\t');
+	outesc(value, size);
+	putchar('\n');
+}
+
+/* print the attributes of the file of path */
+void query(struct capture *cap, const char *path)
+{
+	if (!canonical(path))
+		fprintf(stderr, "path too long %s\n", path);
+	else
+		capture_lookup(cap, canon, print, (void*)path);
+}
+
+void main(int ac, char **av)
+{
+	struct capture cap;
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	int i0 = 1;
+
+	/* get options */
+	while (i0 < ac && av[i0][0] == '-' && av[i0][1] != 0) {
+		if (strcmp(av[i0], "-D") == 0 && i0 + 1 < ac)
+			capture_dictionary(av[++i0]);
+		else
+			break;
+		i0++;
+	}
+
+	/* check argument count */
+	if (ac < i0 + 1) {
+		fprintf(stderr, "usage: %s [-D dict] FILE [PATH...]\n", av[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	/* open the file */
+	capture_open(&cap, av[i0]);
+	if (cap.index == NULL) {
+		fprintf(stderr, "%s has no index, see option -i of sec-xattr-extract\n", cap.path);
+		exit(EXIT_FAILURE);
+	}
+
+	/* query the paths of arguments or of the lines of the standard input */
+	if (ac > i0 + 1) {
+		while (++i0 < ac)
+			query(&cap, av[i0]);
+	}
+	else {
+		while ((len = getline(&line, &size, stdin)) >= 0) {
+			if (len > 0 && line[len - 1] == '\n')
+				line[--len] = 0;
+			if (len > 0)
+				query(&cap, line);
+		}
+		free(line);
+	}
+
+	capture_close(&cap);
+	exit(EXIT_SUCCESS);
+}
@@ -21,8 +21,11 @@
  * $RP_END_LICENSE$
  */
 
+#define _GNU_SOURCE
+
 #include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <fcntl.h>
@@ -35,11 +38,18 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/xattr.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <signal.h>
 
 #include "sec-xattr-cp.h"
 
 char path[PATH_MAX];
 
+/* are the names front coded */
+bool front = false;
+
 #if WITHOUT_EXEC
 #undef WITH_EXEC
 #elif !WITH_EXEC
@@ -54,11 +64,26 @@ char path[PATH_MAX];
 
 #if WITH_EXEC
 extern char **environ;
+
+/* idle priority of I/O for ioprio_set */
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_IDLE (3 << 13)
+
+/* completion of the classes restored in background */
+const char *readyfile = NULL;
+int readysig = 0;
+
+/* delay in milliseconds waiting for a handler of readysig */
+#define CATCH_WAIT_MS 10000
+
+/* write end of the pipe closed by the exec of the program */
+int execfd = -1;
 #endif
 
 #if WITH_DRY_RUN
 
 # define APPLY apply
+# define DRY_RUN (apply == dry_apply)
 
 int (*apply)(const char *path, const char *name, const void *value, size_t size, int flags)
 	= lsetxattr;
@@ -71,16 +96,47 @@ int dry_apply(const char *path, const char *name, const void *value, size_t size
 #else
 
 # define APPLY lsetxattr
+# define DRY_RUN 0
 
 #endif
 
-void *process(uint32_t *pcode, size_t offset, const char *subpath)
-{
-	static const char *attr = NULL;
+/* name of the extended attribute of ROOT recording the stamp */
+#define STAMP_XATTR "trusted.sec-xattr-cp.stamp"
 
-	const char *str;
-	uint32_t code;
-	int rc;
+/* record the stamp in the extended attribute of ROOT or in the file */
+bool stampxattr = false;
+const char *stampfile = NULL;
+
+/* the stamp of the capture, its hash in hexadecimal, or empty */
+char stamp[17] = "";
+bool stamping = false;
+
+/* count of attributes set between two checkpoints */
+#if !CHECK_INTERVAL
+#undef CHECK_INTERVAL
+#define CHECK_INTERVAL 16384
+#endif
+
+/* the file recording the checkpoints and the root for syncing it */
+const char *checkfile = NULL;
+int rootfd = -1;
+
+/* the codes and the index of the class being applied */
+const char *codes;
+uint32_t curclass;
+
+/* count of attributes set since the last checkpoint */
+uint32_t applied = 0;
+
+/* checkpoint to resume from: the attributes set by the codes
+ * of classes before resclass and before until are skipped */
+uint32_t resclass = 0;
+size_t resoffset = 0;
+const uint32_t *until;
+
+/* append the subpath to the path at offset with a trailing slash, returns the new offset */
+size_t subdir(size_t offset, const char *subpath)
+{
 	size_t len;
 
 	/* append the subpath */
@@ -100,6 +156,108 @@ void *process(uint32_t *pcode, size_t offset, const char *subpath)
 		}
 		path[offset++] = '/';
 	}
+	return offset;
+}
+
+/* write the len bytes of data to the file atomically, returns false on error */
+bool put_file(const char *file, const void *data, size_t len)
+{
+	char tmp[PATH_MAX];
+	int fd;
+
+	if (snprintf(tmp, sizeof tmp, "%s.new", file) >= (int)sizeof tmp)
+		return false;
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return false;
+	if (write(fd, data, len) != (ssize_t)len || fsync(fd) < 0) {
+		close(fd);
+		return false;
+	}
+	return close(fd) == 0 && rename(tmp, file) == 0;
+}
+
+/* record that the codes of the current class before pos are applied */
+void checkpoint(const uint32_t *pos)
+{
+	char buf[64];
+	int len;
+
+	applied = 0;
+	if (DRY_RUN)
+		return;
+
+	/* the attributes must be on disk before the checkpoint */
+	if (syncfs(rootfd) < 0)
+		fprintf(stderr, "can't sync: %s\n", strerror(errno));
+	len = snprintf(buf, sizeof buf, "%s %u %zu\n", stamp, curclass,
+			(size_t)((const char*)pos - codes));
+	if (!put_file(checkfile, buf, (size_t)len))
+		fprintf(stderr, "can't write checkpoint %s: %s\n", checkfile, strerror(errno));
+}
+
+/* read the checkpoint of the capture to resume from, if any */
+void resume(struct capture *cap)
+{
+	char buf[64], hash[sizeof stamp], end;
+	unsigned class;
+	size_t offset;
+	ssize_t rc;
+	int fd;
+	bool valid;
+
+	fd = open(checkfile, O_RDONLY);
+	if (fd < 0)
+		return;
+	rc = read(fd, buf, sizeof buf - 1);
+	close(fd);
+	buf[rc < 0 ? 0 : rc] = 0;
+	valid = sscanf(buf, "%16s %u %zu%c", hash, &class, &offset, &end) == 4 && end == '\n';
+	if (valid && strcmp(hash, stamp) != 0) {
+		fprintf(stderr, "ignoring checkpoint %s of an other capture\n", checkfile);
+		return;
+	}
+
+	/* check the class and the offset of its codes */
+	valid = valid && class < cap->classes && offset % sizeof(uint32_t) == 0;
+	if (valid) {
+		capture_class(cap, class);
+		valid = offset < cap->size - (size_t)(cap->body - cap->base);
+		capture_class(cap, 0);
+	}
+	if (!valid) {
+		fprintf(stderr, "ignoring invalid checkpoint %s\n", checkfile);
+		return;
+	}
+	resclass = class;
+	resoffset = offset;
+}
+
+/* put in path at offset the name front coded in str, returns its length */
+size_t frontname(size_t offset, const char *str)
+{
+	size_t pre = (size_t)(uint8_t)str[0];
+	size_t len = strlen(&str[1]) + 1;
+
+	if (offset + pre + len > sizeof path) {
+		fprintf(stderr, "path too long %.*s%s\n", (int)(offset + pre), path, &str[1]);
+		exit(EXIT_FAILURE);
+	}
+	memcpy(&path[offset + pre], &str[1], len);
+	return pre + len - 1;
+}
+
+void *process(uint32_t *pcode, size_t offset, const char *subpath)
+{
+	static const char *attr = NULL;
+
+	const char *str;
+	uint32_t code;
+	int rc;
+	size_t len;
+
+	/* append the subpath */
+	offset = subdir(offset, subpath);
 
 	/* iterate over instructions */
 	for (;;) {
@@ -110,9 +268,20 @@ void *process(uint32_t *pcode, size_t offset, const char *subpath)
 		case TAG_SUB:
 			if (code == TAG_SUB) /* offset == 0 */
 				return pcode;
-			pcode = process(pcode, offset, str);
+			if (applied >= CHECK_INTERVAL && checkfile != NULL)
+				checkpoint(pcode - 1);
+			if (front)
+				pcode = process(pcode, offset + frontname(offset, str), "");
+			else
+				pcode = process(pcode, offset, str);
 			break;
 		case TAG_FILE:
+			if (applied >= CHECK_INTERVAL && checkfile != NULL)
+				checkpoint(pcode - 1);
+			if (front) {
+				frontname(offset, str);
+				break;
+			}
 			len = strlen(str) + 1;
 			if (offset + len > sizeof path) {
 				fprintf(stderr, "path too long %.*s%s\n", (int)offset, path, offset);
@@ -124,69 +293,314 @@ void *process(uint32_t *pcode, size_t offset, const char *subpath)
 			attr = str;
 			break;
 		case TAG_SET:
+			if (pcode <= until) /* applied before the checkpoint */
+				break;
 			len = ((size_t)(uint8_t)str[0]) | (((size_t)(uint8_t)str[1]) << 8);
 			rc = APPLY(path, attr, &str[2], len, 0);
 			if (rc < 0) {
 				fprintf(stderr, "can't set %s of %s\n", attr, path);
 				exit(EXIT_FAILURE);
 			}
+			applied++;
 			break;
 		}
 	}
 }
 
 /*
- * Opens the file 'path' and map it in memory.
- * Returns the position in memory
+ * Process the blocks of a capture of the stream variant.
+ * The blocks are released as soon as processed, so the attribute
+ * name is copied and the directories are recorded in a stack.
  */
-void *mapin(const char *path)
+void stream(struct capture *cap, const char *root)
 {
-	int rc, fd;
-	struct stat st;
-	void *ptr;
+	static size_t stack[PATH_MAX / 2];
+	static char attr[XATTR_NAME_MAX + 1];
+
+	const char *blk, *str;
+	const uint32_t *pcode, *end;
+	uint32_t code, strsz;
+	unsigned depth = 0;
+	size_t offset, len;
+	int rc;
 
-	/* open the file */
-	fd = open(path, O_RDONLY);
-	if (fd < 0) {
-		fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
-		exit(EXIT_FAILURE);
+	offset = subdir(0, root);
+	while ((blk = capture_block(cap)) != NULL) {
+		strsz = le32toh(((const uint32_t*)blk)[0]);
+		pcode = (const uint32_t*)&blk[BLOCK_HEAD + strsz];
+		end = (const uint32_t*)&blk[BLOCK_HEAD + strsz + le32toh(((const uint32_t*)blk)[1])];
+		while (pcode < end) {
+			code = le32toh(*pcode++);
+			str = code == TAG_SUB ? NULL : capture_block_string(cap, blk, code);
+			switch (code & TAG_MASK) {
+			case TAG_SUB:
+				if (code != TAG_SUB) {
+					if (depth == sizeof stack / sizeof *stack) {
+						fprintf(stderr, "too deep %.*s\n", (int)offset, path);
+						exit(EXIT_FAILURE);
+					}
+					stack[depth++] = offset;
+					if (front)
+						offset = subdir(offset + frontname(offset, str), "");
+					else
+						offset = subdir(offset, str);
+				}
+				else if (depth > 0)
+					offset = stack[--depth];
+				else
+					return;
+				break;
+			case TAG_FILE:
+				if (front) {
+					frontname(offset, str);
+					break;
+				}
+				len = strlen(str) + 1;
+				if (offset + len > sizeof path) {
+					fprintf(stderr, "path too long %.*s%s\n", (int)offset, path, str);
+					exit(EXIT_FAILURE);
+				}
+				memcpy(&path[offset], str, len);
+				break;
+			case TAG_ATTR:
+				len = strlen(str) + 1;
+				if (len > sizeof attr) {
+					fprintf(stderr, "attribute name too long %s\n", str);
+					exit(EXIT_FAILURE);
+				}
+				memcpy(attr, str, len);
+				break;
+			case TAG_SET:
+				len = ((size_t)(uint8_t)str[0]) | (((size_t)(uint8_t)str[1]) << 8);
+				rc = APPLY(path, attr, &str[2], len, 0);
+				if (rc < 0) {
+					fprintf(stderr, "can't set %s of %s\n", attr, path);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			}
+		}
 	}
+	fprintf(stderr, "%s is truncated\n", cap->path);
+	exit(EXIT_FAILURE);
+}
+
+/* compute the stamp of the capture */
+void make_stamp(struct capture *cap)
+{
+	uint64_t hash, snapshot;
 
-	/* gets its properties */
-	rc = fstat(fd, &st);
-	if (rc < 0) {
-		fprintf(stderr, "failed to stat %s: %s\n", path, strerror(errno));
+	if (cap->base == NULL) {
+		fprintf(stderr, "can't stamp the streamed capture %s\n", cap->path);
 		exit(EXIT_FAILURE);
 	}
+	hash = capture_hash(cap->base, cap->size, 0);
+	if (cap->snapshots != 0) {
+		snapshot = htole64((uint64_t)(cap->body - cap->base));
+		hash = capture_hash(&snapshot, sizeof snapshot, hash);
+	}
+	snprintf(stamp, sizeof stamp, "%016llx", (unsigned long long)hash);
+}
 
-	/* check it is a regular file */
-	if ((st.st_mode & S_IFMT) != S_IFREG) {
-		fprintf(stderr, "%s should be a regular file\n", path);
-		exit(EXIT_FAILURE);
+/* is the stamp recorded for root? */
+bool has_stamp(const char *root)
+{
+	char buf[sizeof stamp];
+	ssize_t rc;
+	int fd;
+
+	if (stampxattr)
+		rc = lgetxattr(root, STAMP_XATTR, buf, sizeof buf);
+	else {
+		fd = open(stampfile, O_RDONLY);
+		if (fd < 0)
+			return false;
+		rc = read(fd, buf, sizeof buf);
+		close(fd);
+	}
+	return rc >= (ssize_t)sizeof stamp - 1 && memcmp(buf, stamp, sizeof stamp - 1) == 0
+	    && (rc == (ssize_t)sizeof stamp - 1 || buf[sizeof stamp - 1] == '\n');
+}
+
+/* record the stamp for root, failures only warned */
+void put_stamp(const char *root)
+{
+	if (stampxattr) {
+		if (lsetxattr(root, STAMP_XATTR, stamp, sizeof stamp - 1, 0) < 0)
+			fprintf(stderr, "can't set %s of %s: %s\n", STAMP_XATTR, root, strerror(errno));
+		return;
 	}
+	stamp[sizeof stamp - 1] = '\n';
+	if (!put_file(stampfile, stamp, sizeof stamp))
+		fprintf(stderr, "can't write stamp %s: %s\n", stampfile, strerror(errno));
+	stamp[sizeof stamp - 1] = 0;
+}
+
+/* record the end of the restore of root */
+void done(const char *root)
+{
+	if (DRY_RUN)
+		return;
+	if (stamping)
+		put_stamp(root);
+	if (checkfile != NULL && unlink(checkfile) < 0 && errno != ENOENT)
+		fprintf(stderr, "can't remove checkpoint %s: %s\n", checkfile, strerror(errno));
+}
+
+/* apply the codes of the class idx, skipping what the checkpoint recorded */
+void apply_class(struct capture *cap, uint32_t idx, const char *root)
+{
+	if (idx < resclass)
+		return;
+	capture_class(cap, idx);
+	codes = cap->body;
+	curclass = idx;
+	until = (const uint32_t*)codes;
+	if (idx == resclass && resoffset != 0)
+		until = (const uint32_t*)&codes[resoffset];
+	process((uint32_t*)cap->body, 0, root);
+	if (checkfile != NULL && idx + 1 < cap->classes) {
+		curclass = idx + 1;
+		checkpoint((const uint32_t*)codes);
+	}
+}
+
+/* apply the codes of the classes from first */
+void apply_classes(struct capture *cap, uint32_t first, const char *root)
+{
+	uint32_t idx;
+
+	for (idx = first ; idx < cap->classes ; idx++)
+		apply_class(cap, idx, root);
+}
+
+#if WITH_EXEC
+/* does the process pid catch the signal sig? */
+bool caught(pid_t pid, int sig)
+{
+	char buf[4096], *line;
+	unsigned long long mask;
+	ssize_t rc;
+	int fd;
+
+	snprintf(buf, sizeof buf, "/proc/%d/status", (int)pid);
+	fd = open(buf, O_RDONLY);
+	if (fd < 0)
+		return false;
+	rc = read(fd, buf, sizeof buf - 1);
+	close(fd);
+	buf[rc < 0 ? 0 : rc] = 0;
+	line = strstr(buf, "\nSigCgt:");
+	return line != NULL && sscanf(&line[8], "%llx", &mask) == 1
+	    && ((mask >> (sig - 1)) & 1) != 0;
+}
+
+/* report the completion of the restore, signaling pid if not 0 */
+void ready(pid_t pid)
+{
+	int fd, ms;
+
+	if (readyfile != NULL) {
+		fd = open(readyfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
+			fprintf(stderr, "can't create %s: %s\n", readyfile, strerror(errno));
+		else
+			close(fd);
+	}
+	if (readysig != 0 && pid != 0) {
+		/* the default action of most signals would kill the program */
+		for (ms = 0 ; ms < CATCH_WAIT_MS && !caught(pid, readysig) ; ms += 10)
+			usleep(10000);
+		if (ms < CATCH_WAIT_MS)
+			kill(pid, readysig);
+		else
+			fprintf(stderr, "signal %d not caught by %d\n", readysig, (int)pid);
+	}
+}
+
+/* get the number of signal of str */
+int signum(const char *str)
+{
+	char *end;
+	long sig = strtol(str, &end, 10);
 
-	/* map the regular file in memory */
-	ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (ptr == MAP_FAILED) {
-		fprintf(stderr, "failed to mmap %s: %s\n", path, strerror(errno));
+	if (*str == 0 || *end != 0 || sig <= 0 || sig >= NSIG || sig > 64) {
+		fprintf(stderr, "invalid signal %s\n", str);
 		exit(EXIT_FAILURE);
 	}
+	return (int)sig;
+}
 
-	/* check header */
-	if (memcmp(ptr, SEC_XATTR_CP_ID_V1, strlen(SEC_XATTR_CP_ID_V1)) != 0) {
-		fprintf(stderr, "%s isn't of expected format\n", path);
+/* apply the classes after the first one, if cap isn't NULL, and report the
+ * completion in a detached process of low priority */
+void background(struct capture *cap, const char *root)
+{
+	pid_t parent = getpid(), pid;
+	int fds[2], status;
+	ssize_t rc;
+	char c;
+
+	/* the pipe is closed by the exec of the program */
+	if (pipe2(fds, O_CLOEXEC) < 0) {
+		fprintf(stderr, "can't create pipe: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	fflush(NULL);
+	pid = fork();
+	if (pid < 0) {
+		fprintf(stderr, "can't fork: %s\n", strerror(errno));
 		exit(EXIT_FAILURE);
 	}
+	if (pid > 0) {
+		/* the intermediate process ends at once */
+		close(fds[0]);
+		execfd = fds[1];
+		if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			exit(EXIT_FAILURE);
+		return;
+	}
+
+	/* detach the grand child */
+	pid = fork();
+	if (pid != 0) {
+		if (pid < 0)
+			fprintf(stderr, "can't fork: %s\n", strerror(errno));
+		_exit(pid < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+	setsid();
+	setpriority(PRIO_PROCESS, 0, 19);
+	syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_IDLE);
+
+	/* wait the exec of the program, a byte is written if it failed */
+	close(fds[1]);
+	while ((rc = read(fds[0], &c, 1)) < 0 && errno == EINTR);
+	close(fds[0]);
+	if (rc != 0)
+		parent = 0;
+
+	/* apply the remaining classes */
+	if (cap != NULL) {
+		apply_classes(cap, 1, root);
+		done(root);
+	}
 
-	/* return the values */
-	return (void*)(((char*)ptr) + strlen(SEC_XATTR_CP_ID_V1));
+	ready(parent);
+	_exit(EXIT_SUCCESS);
 }
+#endif
 
 void usage(char **av)
 {
 	fprintf(stderr, "usage: %s"
 #if WITH_DRY_RUN
 		" [-d]"
+#endif
+		" [-D dict]"
+		" [-n name]"
+		" [-a|-S stampfile]"
+		" [-c checkfile [--resume]]"
+#if WITH_EXEC
+		" [-r readyfile] [-k signal]"
 #endif
 		" FILE ROOT"
 #if WITH_EXEC
@@ -198,15 +612,40 @@ void usage(char **av)
 
 void main(int ac, char **av)
 {
-	uint32_t *ptr;
+	struct capture cap;
+	const char *snapshot = NULL;
+	bool pending = false, resuming = false;
 	int i0 = 1;
 
+	/* get options */
+	while (i0 < ac && av[i0][0] == '-' && av[i0][1] != 0) {
 #if WITH_DRY_RUN
-	if (ac > 1 && strcmp(av[1], "-d") == 0) {
-		apply = dry_apply;
+		if (strcmp(av[i0], "-d") == 0)
+			apply = dry_apply;
+		else
+#endif
+		if (strcmp(av[i0], "-D") == 0 && i0 + 1 < ac)
+			capture_dictionary(av[++i0]);
+		else if (strcmp(av[i0], "-n") == 0 && i0 + 1 < ac)
+			snapshot = av[++i0];
+		else if (strcmp(av[i0], "-a") == 0)
+			stampxattr = true;
+		else if (strcmp(av[i0], "-S") == 0 && i0 + 1 < ac)
+			stampfile = av[++i0];
+		else if (strcmp(av[i0], "-c") == 0 && i0 + 1 < ac)
+			checkfile = av[++i0];
+		else if (strcmp(av[i0], "--resume") == 0)
+			resuming = true;
+#if WITH_EXEC
+		else if (strcmp(av[i0], "-r") == 0 && i0 + 1 < ac)
+			readyfile = av[++i0];
+		else if (strcmp(av[i0], "-k") == 0 && i0 + 1 < ac)
+			readysig = signum(av[++i0]);
+#endif
+		else
+			usage(av);
 		i0++;
 	}
-#endif
 
 	/* check argument count */
 #if WITH_EXEC
@@ -215,18 +654,74 @@ void main(int ac, char **av)
 	if (ac != i0 + 2)
 #endif
 		usage(av);
+	if (resuming && checkfile == NULL)
+		usage(av);
+
+	/* open the file */
+	capture_open(&cap, av[i0]);
+	if (snapshot != NULL)
+		capture_select(&cap, snapshot);
 
-	/* map the file */
-	ptr = mapin(av[i0]);
+	/* the checkpoints need the stamp and the codes of the whole capture */
+	if (checkfile != NULL && (cap.flags & FLAG_STREAM)) {
+		fprintf(stderr, "can't checkpoint the streamed capture %s\n", cap.path);
+		exit(EXIT_FAILURE);
+	}
 
-	/* process the root */
-	process(ptr, 0, av[i0 + 1]);
+	/* nothing to do if the stamp of the capture is recorded */
+	stamping = stampxattr || stampfile != NULL;
+	if (stamping || checkfile != NULL)
+		make_stamp(&cap);
+	if (!stamping || !has_stamp(av[i0 + 1])) {
+		/* prepare the checkpoints */
+		if (checkfile != NULL) {
+			if (resuming)
+				resume(&cap);
+			if (!DRY_RUN) {
+				rootfd = open(av[i0 + 1], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+				if (rootfd < 0) {
+					fprintf(stderr, "can't open %s: %s\n", av[i0 + 1], strerror(errno));
+					exit(EXIT_FAILURE);
+				}
+			}
+		}
 
+		/* process the root */
+		front = (cap.flags & FLAG_FRONT) != 0;
+		if (cap.flags & FLAG_STREAM)
+			stream(&cap, av[i0 + 1]);
 #if WITH_EXEC
+		else if (cap.classes > 1 && ac > i0 + 2 && !DRY_RUN) {
+			/* only the first class is applied before executing the program,
+			 * the others and the stamp are done in background */
+			apply_class(&cap, 0, av[i0 + 1]);
+			background(&cap, av[i0 + 1]);
+			pending = true;
+		}
+#endif
+		else
+			apply_classes(&cap, 0, av[i0 + 1]);
+
+		/* record the end */
+		if (!pending)
+			done(av[i0 + 1]);
+	}
+
+#if WITH_EXEC
+	if (!pending && !DRY_RUN) {
+		ready(0);
+		/* the program is signaled when it catches the signal */
+		if (readysig != 0 && ac > i0 + 2) {
+			readyfile = NULL;
+			background(NULL, NULL);
+		}
+	}
 	i0 += 2;
 	if (ac > i0) {
 		execve(av[i0], &av[i0], environ);
 		fprintf(stderr, "can't exec %s: %s\n", av[i0], strerror(errno));
+		if (execfd >= 0)
+			write(execfd, "", 1);
 		exit(EXIT_FAILURE);
 	}
 #endif